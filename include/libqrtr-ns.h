@@ -0,0 +1,89 @@
+#ifndef _LIBQRTR_NS_H_
+#define _LIBQRTR_NS_H_
+
+#include <linux/qrtr.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/*
+ * The QRTR name service, for embedding in a process which owns the control
+ * socket and its event loop. qrtr-ns is one such host.
+ */
+struct qrtr_ns;
+
+/**
+ * struct qrtr_ns_ops - Transport of a name service
+ * @send:	Send a control message, negative return on failure
+ * @resume:	Remote port resumed transmission, optional
+ * @drop:	Remote port, or node with port 0, went away, optional
+ * @probe:	Check a local port is open, e.g. sending it an empty message,
+ *		-ENODEV or -ECONNRESET when it's not, other errors leave it
+ *		trusted, optional
+ */
+struct qrtr_ns_ops {
+	int (*send)(void *data, const struct sockaddr_qrtr *to,
+		    const void *buf, size_t len);
+	void (*resume)(void *data, unsigned int node, unsigned int port);
+	void (*drop)(void *data, unsigned int node, unsigned int port);
+	int (*probe)(void *data, unsigned int node, unsigned int port);
+};
+
+/**
+ * struct qrtr_ns_limits - Admission control, 0 for unlimited
+ * @client_rate:	Packets per second from a node:port
+ * @client_burst:	Packets a node:port may send at once
+ * @node_rate:		Packets per second from all ports of a remote node
+ * @node_burst:		Packets a remote node may send at once
+ * @max_lookups:	Lookups per local client
+ * @max_servers:	Servers per node
+ */
+struct qrtr_ns_limits {
+	unsigned int client_rate;
+	unsigned int client_burst;
+	unsigned int node_rate;
+	unsigned int node_burst;
+	unsigned int max_lookups;
+	unsigned int max_servers;
+};
+
+/**
+ * struct qrtr_ns_stats - Packets refused by admission control
+ * @rate_limited:	Over the rate of the client or its node
+ * @lookups_capped:	NEW_LOOKUP over max_lookups
+ * @servers_capped:	NEW_SERVER over max_servers
+ */
+struct qrtr_ns_stats {
+	unsigned long rate_limited;
+	unsigned long lookups_capped;
+	unsigned long servers_capped;
+};
+
+/* Only these are exported, the helpers of the library are hidden */
+#pragma GCC visibility push(default)
+
+struct qrtr_ns *qrtr_ns_create(unsigned int local_node,
+			       const struct qrtr_ns_ops *ops, void *data);
+void qrtr_ns_destroy(struct qrtr_ns *ns);
+
+void qrtr_ns_set_resync(struct qrtr_ns *ns, bool enable);
+void qrtr_ns_set_limits(struct qrtr_ns *ns,
+			const struct qrtr_ns_limits *limits);
+void qrtr_ns_get_stats(struct qrtr_ns *ns, struct qrtr_ns_stats *stats);
+int qrtr_ns_say_hello(struct qrtr_ns *ns);
+int qrtr_ns_process_packet(struct qrtr_ns *ns,
+			   const struct sockaddr_qrtr *from,
+			   const void *buf, size_t len);
+
+int qrtr_ns_state_save(struct qrtr_ns *ns, void **data, size_t *len);
+int qrtr_ns_state_load(struct qrtr_ns *ns, const void *data, size_t len,
+		       bool stale);
+bool qrtr_ns_state_dirty(struct qrtr_ns *ns);
+void qrtr_ns_state_clean(struct qrtr_ns *ns);
+unsigned int qrtr_ns_sweep_stale(struct qrtr_ns *ns);
+
+int qrtr_ns_trace_save(struct qrtr_ns *ns, void **data, size_t *len);
+
+#pragma GCC visibility pop
+
+#endif
@@ -4,6 +4,7 @@
 #include <linux/qrtr.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -40,6 +41,20 @@ struct qrtr_packet {
 	size_t data_len;
 };
 
+/**
+ * struct qrtr_dest - destination of a fan-out send
+ * @node:	Node of the destination
+ * @port:	Port of the destination
+ * @txn_id:	QMI transaction id to use for this destination
+ * @err:	Updated with 0, or the errno of the failed send
+ */
+struct qrtr_dest {
+	uint32_t node;
+	uint32_t port;
+	uint16_t txn_id;
+	int err;
+};
+
 #define DEFINE_QRTR_PACKET(pkt, size) \
 	char pkt ## _buf[size]; \
 	struct qrtr_packet pkt = { .data = pkt ##_buf, \
@@ -66,10 +81,16 @@ enum qmi_elem_type {
 	QMI_STRING,
 };
 
+/*
+ * VAR_LEN_ARRAY_PTR elements are like VAR_LEN_ARRAY, but the C structure
+ * only holds a pointer to the elements, which are decoded into a struct
+ * qmi_arena. QMI_STRING elements may use it to hold a char pointer.
+ */
 enum qmi_array_type {
 	NO_ARRAY,
 	STATIC_ARRAY,
 	VAR_LEN_ARRAY,
+	VAR_LEN_ARRAY_PTR,
 };
 
 /**
@@ -95,6 +116,61 @@ struct qmi_elem_info {
 	struct qmi_elem_info *ei_array;
 };
 
+/**
+ * struct qmi_arena - memory for out-of-line elements of decoded messages
+ * @base:	Start of the arena memory
+ * @size:	Size of the arena memory
+ * @used:	Number of bytes handed out since the last reset
+ */
+struct qmi_arena {
+	void *base;
+	size_t size;
+	size_t used;
+};
+
+/**
+ * struct qmi_tlv_iter - iterator over the TLVs of an encoded QMI message
+ * @pos:	Next TLV to be parsed
+ * @end:	End of the message
+ * @tlv:	Current TLV, starting with its header
+ * @type:	Type of the current TLV
+ * @len:	Length of the value of the current TLV
+ * @value:	Value of the current TLV, in wire format
+ */
+struct qmi_tlv_iter {
+	const uint8_t *pos;
+	const uint8_t *end;
+	const uint8_t *tlv;
+	uint8_t type;
+	uint16_t len;
+	const void *value;
+};
+
+struct qmi_service;
+
+/* Pool of refcounted buffers, in size classes, for packet data */
+struct qrtr_pool;
+
+/**
+ * struct qmi_msg_handler - handler of a QMI request
+ * @msg_id:	Message ID of the request
+ * @req_ei:	QMI message descriptor of the request
+ * @req_size:	Size of the C structure of the request
+ * @resp_ei:	QMI message descriptor of the response, NULL for no response
+ * @resp_size:	Size of the C structure of the response
+ * @fn:		Handler, filling in the zeroed @resp. A negative return value
+ *		suppresses the response.
+ */
+struct qmi_msg_handler {
+	unsigned int msg_id;
+	struct qmi_elem_info *req_ei;
+	size_t req_size;
+	struct qmi_elem_info *resp_ei;
+	size_t resp_size;
+	int (*fn)(struct qmi_service *svc, unsigned int node, unsigned int port,
+		  const void *req, void *resp);
+};
+
 #define QMI_RESULT_SUCCESS_V01                  0
 #define QMI_RESULT_FAILURE_V01                  1
 
@@ -124,6 +200,10 @@ int qrtr_open(int rport);
 void qrtr_close(int sock);
 
 int qrtr_sendto(int sock, uint32_t node, uint32_t port, const void *data, unsigned int sz);
+int qrtr_sendmsg_iov(int sock, uint32_t node, uint32_t port,
+		     const struct iovec *iov, int iovcnt);
+int qrtr_sendto_many(int sock, struct qrtr_dest *dests, unsigned int count,
+		     const void *data, unsigned int sz);
 int qrtr_recvfrom(int sock, void *buf, unsigned int bsz, uint32_t *node, uint32_t *port);
 int qrtr_recv(int sock, void *buf, unsigned int bsz);
 
@@ -135,19 +215,83 @@ int qrtr_bye(int sock, uint32_t service, uint16_t version, uint16_t instance);
 
 int qrtr_new_lookup(int sock, uint32_t service, uint16_t version, uint16_t instance);
 int qrtr_remove_lookup(int sock, uint32_t service, uint16_t version, uint16_t instance);
+int qrtr_lookup(int sock, uint32_t service, uint32_t instance, uint32_t ifilter,
+		void (*cb)(void *udata, uint32_t service, uint32_t instance,
+			   uint32_t node, uint32_t port),
+		void *udata);
+int qrtr_lookup_range(int sock, uint32_t service, uint32_t instance,
+		      uint32_t ifilter, uint32_t imin, uint32_t imax,
+		      void (*cb)(void *udata, uint32_t service,
+				 uint32_t instance, uint32_t node,
+				 uint32_t port),
+		      void *udata);
 
 int qrtr_poll(int sock, unsigned int ms);
 
 int qrtr_decode(struct qrtr_packet *dest, void *buf, size_t len,
 		const struct sockaddr_qrtr *sq);
 
+struct qrtr_pool *qrtr_pool_create(void);
+void qrtr_pool_destroy(struct qrtr_pool *pool);
+void *qrtr_pool_alloc(struct qrtr_pool *pool, size_t size);
+void *qrtr_pool_get(void *data);
+void qrtr_pool_put(void *data);
+size_t qrtr_pool_buf_size(const void *data);
+
+ssize_t qrtr_pending_size(int sock);
+int qrtr_recv_pooled(int sock, struct qrtr_pool *pool, struct qrtr_packet *pkt,
+		     struct sockaddr_qrtr *sq);
+int qrtr_recv_batch(int sock, struct qrtr_pool *pool, struct qrtr_packet *pkts,
+		    struct sockaddr_qrtr *sqs, unsigned int count, int flags);
+
 int qmi_decode_header(const struct qrtr_packet *pkt, unsigned int *msg_id);
 int qmi_decode_message(void *c_struct, unsigned int *txn,
 		       const struct qrtr_packet *pkt,
 		       int type, int id, struct qmi_elem_info *ei);
+int qmi_decode_message_arena(void *c_struct, unsigned int *txn,
+			     const struct qrtr_packet *pkt,
+			     int type, int id, struct qmi_elem_info *ei,
+			     struct qmi_arena *arena);
 ssize_t qmi_encode_message(struct qrtr_packet *pkt, int type, int msg_id,
 			   int txn_id, const void *c_struct,
 			   struct qmi_elem_info *ei);
+ssize_t qmi_encoded_size(const void *c_struct, struct qmi_elem_info *ei);
+ssize_t qmi_encode_message_alloc(struct qrtr_packet *pkt, size_t *size,
+				 int type, int msg_id, int txn_id,
+				 const void *c_struct, struct qmi_elem_info *ei);
+ssize_t qmi_encode_message_pool(struct qrtr_pool *pool, struct qrtr_packet *pkt,
+				int type, int msg_id, int txn_id,
+				const void *c_struct, struct qmi_elem_info *ei);
+int qmi_send_indication_many(int sock, struct qrtr_dest *dests,
+			     unsigned int count, int msg_id,
+			     const void *c_struct, struct qmi_elem_info *ei);
+ssize_t qmi_encode_message_iov(struct iovec *iov, int *iovcnt,
+			       void *buf, size_t buf_len,
+			       int type, int msg_id, int txn_id,
+			       const void *c_struct, struct qmi_elem_info *ei);
+
+int qmi_tlv_iter_init(struct qmi_tlv_iter *iter, const struct qrtr_packet *pkt);
+int qmi_tlv_iter_next(struct qmi_tlv_iter *iter);
+int qmi_tlv_iter_find(struct qmi_tlv_iter *iter, uint8_t type);
+int qmi_tlv_decode(const struct qmi_tlv_iter *iter, void *c_struct,
+		   struct qmi_elem_info *ei);
+
+void qmi_arena_init(struct qmi_arena *arena, void *buf, size_t size);
+void qmi_arena_reset(struct qmi_arena *arena);
+
+struct qmi_service *qmi_service_create(uint32_t service, uint16_t version,
+				       uint16_t instance,
+				       const struct qmi_msg_handler *handlers,
+				       unsigned int count, void *data);
+void qmi_service_destroy(struct qmi_service *svc);
+int qmi_service_fd(struct qmi_service *svc);
+void *qmi_service_data(struct qmi_service *svc);
+/* @port is 0 when all clients on @node are gone */
+void qmi_service_set_disconnect(struct qmi_service *svc,
+				void (*fn)(struct qmi_service *svc,
+					   unsigned int node,
+					   unsigned int port));
+int qmi_service_process(struct qmi_service *svc);
 
 /* Initial kernel header didn't expose these */
 #ifndef QRTR_NODE_BCAST
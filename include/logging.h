@@ -13,6 +13,8 @@
 
 void qlog_setup(const char *tag, bool use_syslog);
 void qlog_set_min_priority(int priority);
+int qlog_start_async(void);
+void qlog_stop_async(void);
 
 void qlog(int priority, const char *format, ...) __PRINTF__(2, 3);
 
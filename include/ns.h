@@ -6,5 +6,137 @@
 
 static inline __le32 cpu_to_le32(uint32_t x) { return htole32(x); }
 static inline uint32_t le32_to_cpu(__le32 x) { return le32toh(x); }
+static inline __le64 cpu_to_le64(uint64_t x) { return htole64(x); }
+static inline uint64_t le64_to_cpu(__le64 x) { return le64toh(x); }
+
+/*
+ * Private extensions of the control protocol, between libqrtr and qrtr-ns.
+ * Name services not knowing about these ignore the flags and reply the
+ * classic way.
+ */
+
+/* NEW_LOOKUP and DEL_LOOKUP flags, passed in server.port */
+#define QRTR_LOOKUP_F_PACKED	0x1
+#define QRTR_LOOKUP_F_RANGE	0x2
+
+/*
+ * With QRTR_LOOKUP_F_RANGE, NEW_LOOKUP and DEL_LOOKUP are extended by an
+ * instance mask and range. Servers match when (instance & ifilter) equals
+ * the instance of the extension and instance is within [imin, imax]. The
+ * instance of pkt.server stays 0, so that name services unaware of the
+ * extension report all instances of the service.
+ */
+struct qrtr_ctrl_lookup_ext {
+	struct qrtr_ctrl_pkt pkt;
+	__le32 instance;
+	__le32 ifilter;
+	__le32 imin;
+	__le32 imax;
+};
+
+/* Multiple NEW_SERVER records in one lookup reply */
+#define QRTR_TYPE_NEW_SERVER_PACKED	0x1000
+
+#define QRTR_PACKED_MAX_SIZE	4096
+
+struct qrtr_server_rec {
+	__le32 service;
+	__le32 instance;
+	__le32 node;
+	__le32 port;
+};
+
+struct qrtr_ctrl_packed {
+	__le32 cmd;
+	__le32 count;
+	struct qrtr_server_rec recs[];
+};
+
+#define QRTR_PACKED_MAX_RECS \
+	((QRTR_PACKED_MAX_SIZE - sizeof(struct qrtr_ctrl_packed)) / \
+	 sizeof(struct qrtr_server_rec))
+
+/*
+ * Incremental resync between name services. HELLO carries the epoch and
+ * generation of the sender's registry; a peer knowing the extension replies
+ * with its own, flagged as a reply, instead of announcing all servers. Each
+ * side then asks the other for the changes since the generation it saw last,
+ * unless it has seen the announced one already. Name services unaware of it
+ * echo the HELLO as is, which the sender recognizes by its own epoch.
+ */
+#define QRTR_HELLO_F_RESYNC	0x1
+/* The HELLO answers another one, and is never answered itself */
+#define QRTR_HELLO_F_REPLY	0x2
+
+struct qrtr_ctrl_hello_ext {
+	struct qrtr_ctrl_pkt pkt;
+	__le32 flags;
+	__le32 epoch;
+	__le32 gen;
+};
+
+/* RESYNC_REQ, asking for the changes since epoch and gen */
+#define QRTR_TYPE_RESYNC_REQ	0x1001
+/* RESYNC_ACK, announcing what follows, all servers with RESYNC_F_FULL */
+#define QRTR_TYPE_RESYNC_ACK	0x1002
+/* RESYNC_DATA, packed records, service 0 for the removal of port */
+#define QRTR_TYPE_RESYNC_DATA	0x1003
+/* RESYNC_DONE, the peer is in sync with epoch and gen */
+#define QRTR_TYPE_RESYNC_DONE	0x1004
+
+#define QRTR_RESYNC_F_FULL	0x1
+
+struct qrtr_ctrl_resync {
+	__le32 cmd;
+	__le32 epoch;
+	__le32 gen;
+	__le32 flags;
+};
+
+/*
+ * TRACE_REQ, from a local client, asking for the trace ring of the name
+ * service. Answered by TRACE_DATA packets of records, oldest first, then an
+ * empty TRACE_DATA.
+ */
+#define QRTR_TYPE_TRACE_REQ	0x1005
+#define QRTR_TYPE_TRACE_DATA	0x1006
+
+/*
+ * A control packet handled, at ts nanoseconds of CLOCK_MONOTONIC. The
+ * server, or client, the packet is about is in service, instance, node and
+ * port, result is a negative errno on failure.
+ */
+struct qrtr_trace_rec {
+	__le64 ts;
+	__le32 cmd;
+	__le32 src_node;
+	__le32 src_port;
+	__le32 service;
+	__le32 instance;
+	__le32 node;
+	__le32 port;
+	__le32 result;
+};
+
+struct qrtr_ctrl_trace {
+	__le32 cmd;
+	__le32 count;
+	struct qrtr_trace_rec recs[];
+};
+
+#define QRTR_TRACE_MAX_RECS \
+	((QRTR_PACKED_MAX_SIZE - sizeof(struct qrtr_ctrl_trace)) / \
+	 sizeof(struct qrtr_trace_rec))
+
+/* Trace ring dumped to a file, followed by count records */
+#define QRTR_TRACE_MAGIC	0x71747263
+#define QRTR_TRACE_VERSION	1
+
+struct qrtr_trace_file {
+	__le32 magic;
+	__le32 version;
+	__le32 count;
+	__le32 reserved;
+};
 
 #endif
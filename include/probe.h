@@ -0,0 +1,21 @@
+#ifndef _QRTR_PROBE_H_
+#define _QRTR_PROBE_H_
+
+/*
+ * USDT probes of the "qrtr" provider, for bpftrace and perf to attach to.
+ * Each is a single nop plus an ELF note, or nothing at all when built
+ * without sys/sdt.h.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define QRTR_PROBE(name, ...)	STAP_PROBEV(qrtr, name, ##__VA_ARGS__)
+#else
+/* Keeps the arguments referenced, without evaluating them */
+static inline void qrtr_probe_nop(int unused, ...) { (void)unused; }
+
+#define QRTR_PROBE(name, ...) \
+	do { if (0) qrtr_probe_nop(0, ##__VA_ARGS__); } while (0)
+#endif
+
+#endif
@@ -1,16 +1,63 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <syslog.h>
+#include <unistd.h>
+
+#include "logging.h"
 
 #define QLOG_BUF_SIZE 512
 
+/* Messages queued for the logging thread, a power of two */
+#define QLOG_QUEUE_SIZE		256
+#define QLOG_QUEUE_MASK		(QLOG_QUEUE_SIZE - 1)
+
 static const char default_tag[] = "libqrtr";
 static const char *current_tag = default_tag;
 static int min_priority = LOG_INFO;
 
 static bool logging_to_syslog = false;
 
+/*
+ * Bounded multi-producer queue, each slot's seq tells whose turn it is:
+ * equal to the position for the producer claiming it, position + 1 once
+ * the message is in for the consumer.
+ */
+struct qlog_entry {
+	unsigned int seq;
+	int priority;
+	char msg[QLOG_BUF_SIZE];
+};
+
+struct qlog_queue {
+	struct qlog_entry *entries;
+
+	/* Claimed by producers */
+	unsigned int head __attribute__((aligned(64)));
+	unsigned long dropped;
+	/* Producers between seeing the thread running and publishing */
+	unsigned int writers;
+
+	/* Written by the logging thread only */
+	unsigned int tail __attribute__((aligned(64)));
+	int sleeping;
+
+	int efd;
+	pthread_t thread;
+	bool running;
+	int stop;
+};
+
+static struct qlog_queue qlog_queue = { .efd = -1 };
+
 void qlog_setup(const char *tag, bool use_syslog)
 {
 	current_tag = tag;
@@ -50,6 +97,219 @@ static const char *get_priority_string(int priority)
 	return "";
 }
 
+static void qlog_write(int priority, const char *msg)
+{
+	if (logging_to_syslog)
+		syslog(priority, "%s", msg);
+	else
+		fprintf(stderr, "%s %s: %s\n",
+			get_priority_string(priority), current_tag, msg);
+}
+
+static void qlog_wake(struct qlog_queue *q)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+	/* Can only fail when a wakeup is pending already */
+	n = write(q->efd, &one, sizeof(one));
+	(void)n;
+}
+
+/* Formats the message into the queue, false when it's full */
+static bool qlog_enqueue(struct qlog_queue *q, int priority,
+			 const char *format, va_list ap)
+{
+	struct qlog_entry *e;
+	unsigned int pos;
+	int diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for (;;) {
+		e = &q->entries[pos & QLOG_QUEUE_MASK];
+		diff = (int)(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff < 0)
+			return false;
+
+		if (diff > 0)
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		else if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+						     true, __ATOMIC_RELAXED,
+						     __ATOMIC_RELAXED))
+			break;
+	}
+
+	e->priority = priority;
+	vsnprintf(e->msg, sizeof(e->msg), format, ap);
+
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST))
+		qlog_wake(q);
+
+	return true;
+}
+
+static bool qlog_pending(struct qlog_queue *q)
+{
+	struct qlog_entry *e = &q->entries[q->tail & QLOG_QUEUE_MASK];
+
+	return __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == q->tail + 1;
+}
+
+static void qlog_idle(struct qlog_queue *q)
+{
+	struct pollfd pfd = { .fd = q->efd, .events = POLLIN };
+	uint64_t val;
+	ssize_t n;
+
+	__atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	/* Recheck, a producer might have missed that we're going to sleep */
+	if (qlog_pending(q) || __atomic_load_n(&q->stop, __ATOMIC_SEQ_CST))
+		goto out;
+
+	if (poll(&pfd, 1, -1) > 0) {
+		/* Failing only makes the next poll() return right away */
+		n = read(q->efd, &val, sizeof(val));
+		(void)n;
+	}
+
+out:
+	__atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static void *qlog_thread(void *data)
+{
+	struct qlog_queue *q = data;
+	char buf[QLOG_BUF_SIZE];
+	unsigned long dropped;
+	struct qlog_entry *e;
+
+	for (;;) {
+		if (qlog_pending(q)) {
+			e = &q->entries[q->tail & QLOG_QUEUE_MASK];
+			qlog_write(e->priority, e->msg);
+
+			__atomic_store_n(&e->seq, q->tail + QLOG_QUEUE_SIZE,
+					 __ATOMIC_RELEASE);
+			q->tail++;
+			continue;
+		}
+
+		dropped = __atomic_exchange_n(&q->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			snprintf(buf, sizeof(buf), "dropped %lu log messages",
+				 dropped);
+			qlog_write(LOG_WARNING, buf);
+		}
+
+		/* Drained, only stop once everything is written */
+		if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		qlog_idle(q);
+	}
+
+	return NULL;
+}
+
+/**
+ * qlog_start_async() - Write log messages from a thread of their own
+ *
+ * qlog() then only formats the message into a queue and returns, so a
+ * backed up syslog or stderr never blocks the caller. Messages logged
+ * while the queue is full are dropped and counted. The queue is flushed at
+ * exit, or by qlog_stop_async().
+ *
+ * Threads don't survive fork(), so this is to be called after forking.
+ *
+ * Return: 0 on success, -1 on failure, leaving logging synchronous.
+ */
+int qlog_start_async(void)
+{
+	struct qlog_queue *q = &qlog_queue;
+	static bool registered;
+	unsigned int i;
+
+	if (q->running)
+		return 0;
+
+	/* Kept when stopped, for a restart */
+	if (!q->entries) {
+		q->entries = calloc(QLOG_QUEUE_SIZE, sizeof(*q->entries));
+		if (!q->entries)
+			return -1;
+
+		q->efd = eventfd(0, EFD_CLOEXEC);
+		if (q->efd < 0) {
+			free(q->entries);
+			q->entries = NULL;
+			return -1;
+		}
+	}
+
+	for (i = 0; i < QLOG_QUEUE_SIZE; i++)
+		q->entries[i].seq = i;
+	q->head = 0;
+	q->tail = 0;
+	q->stop = 0;
+
+	if (pthread_create(&q->thread, NULL, qlog_thread, q))
+		return -1;
+
+	if (!registered) {
+		atexit(qlog_stop_async);
+		registered = true;
+	}
+
+	__atomic_store_n(&q->running, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Writes out everything queued, then logs synchronously again. Not to be
+ * called concurrently with qlog_start_async().
+ */
+void qlog_stop_async(void)
+{
+	struct qlog_queue *q = &qlog_queue;
+
+	if (!__atomic_load_n(&q->running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&q->running, false, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Producers which saw the thread running still get their message
+	 * written, so none is lost and a restart can't reset the queue
+	 * under them
+	 */
+	while (__atomic_load_n(&q->writers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	__atomic_store_n(&q->stop, 1, __ATOMIC_SEQ_CST);
+	qlog_wake(q);
+
+	pthread_join(q->thread, NULL);
+}
+
+/* Queues the message while the thread runs, false to log synchronously */
+static bool qlog_async(struct qlog_queue *q, int priority, const char *format,
+		       va_list ap)
+{
+	bool running;
+
+	/* Pairs with qlog_stop_async(), which waits for writers to leave */
+	__atomic_add_fetch(&q->writers, 1, __ATOMIC_SEQ_CST);
+	running = __atomic_load_n(&q->running, __ATOMIC_SEQ_CST);
+	if (running && !qlog_enqueue(q, priority, format, ap))
+		__atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&q->writers, 1, __ATOMIC_RELEASE);
+
+	return running;
+}
+
 void qlog(int priority, const char *format, ...)
 {
 	va_list ap;
@@ -59,7 +319,9 @@ void qlog(int priority, const char *format, ...)
 
 	va_start(ap, format);
 
-	if (logging_to_syslog) {
+	if (qlog_async(&qlog_queue, priority, format, ap)) {
+		/* Queued, or counted as dropped */
+	} else if (logging_to_syslog) {
 		vsyslog(priority, format, ap);
 	} else {
 		char buf[QLOG_BUF_SIZE];
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <libqrtr.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logging.h"
+
+/* Buffers kept on each free list, beyond this they're released */
+#define QRTR_POOL_MAX_FREE	64
+
+static const size_t qrtr_pool_classes[] = { 256, 1024, 4096, 16384, 65536 };
+
+#define QRTR_POOL_NCLASSES \
+	(sizeof(qrtr_pool_classes) / sizeof(qrtr_pool_classes[0]))
+
+struct qrtr_pool_buf {
+	struct qrtr_pool *pool;
+	struct qrtr_pool_buf *next;
+
+	unsigned int refcount;
+	int class;
+	size_t size;
+
+	char data[] __attribute__((aligned(16)));
+};
+
+struct qrtr_pool {
+	pthread_mutex_t lock;
+
+	struct qrtr_pool_buf *free[QRTR_POOL_NCLASSES];
+	unsigned int nfree[QRTR_POOL_NCLASSES];
+
+	unsigned int outstanding;
+	bool destroyed;
+};
+
+static struct qrtr_pool_buf *qrtr_pool_buf(const void *data)
+{
+	return container_of(data, struct qrtr_pool_buf, data);
+}
+
+struct qrtr_pool *qrtr_pool_create(void)
+{
+	struct qrtr_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return pool;
+}
+
+static void qrtr_pool_free(struct qrtr_pool *pool)
+{
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/**
+ * qrtr_pool_destroy() - Destroy a buffer pool
+ * @pool:	Pool to destroy
+ *
+ * Cached buffers are released immediately. Buffers still referenced remain
+ * valid, and the pool is freed once the last of them is put.
+ */
+void qrtr_pool_destroy(struct qrtr_pool *pool)
+{
+	struct qrtr_pool_buf *buf;
+	bool last;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < QRTR_POOL_NCLASSES; i++) {
+		while ((buf = pool->free[i])) {
+			pool->free[i] = buf->next;
+			free(buf);
+		}
+		pool->nfree[i] = 0;
+	}
+	pool->destroyed = true;
+	last = !pool->outstanding;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (last)
+		qrtr_pool_free(pool);
+}
+
+/**
+ * qrtr_pool_alloc() - Allocate a buffer from a pool
+ * @pool:	Pool to allocate from
+ * @size:	Minimum size of the buffer
+ *
+ * The buffer is taken from the free list of the smallest size class that
+ * fits @size, or allocated if that list is empty. Requests larger than the
+ * largest class are served directly by malloc().
+ *
+ * Return: Buffer holding a single reference, or NULL on failure.
+ */
+void *qrtr_pool_alloc(struct qrtr_pool *pool, size_t size)
+{
+	struct qrtr_pool_buf *buf = NULL;
+	int class;
+
+	for (class = 0; class < QRTR_POOL_NCLASSES; class++) {
+		if (size <= qrtr_pool_classes[class])
+			break;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (class < QRTR_POOL_NCLASSES && pool->free[class]) {
+		buf = pool->free[class];
+		pool->free[class] = buf->next;
+		pool->nfree[class]--;
+	}
+	pool->outstanding++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!buf) {
+		if (class < QRTR_POOL_NCLASSES)
+			size = qrtr_pool_classes[class];
+		else
+			class = -1;
+
+		buf = malloc(sizeof(*buf) + size);
+		if (!buf) {
+			pthread_mutex_lock(&pool->lock);
+			pool->outstanding--;
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+
+		buf->pool = pool;
+		buf->class = class;
+		buf->size = size;
+	}
+
+	buf->next = NULL;
+	buf->refcount = 1;
+
+	return buf->data;
+}
+
+/**
+ * qrtr_pool_get() - Take an additional reference to a pool buffer
+ * @data:	Buffer returned by qrtr_pool_alloc()
+ *
+ * Return: @data
+ */
+void *qrtr_pool_get(void *data)
+{
+	struct qrtr_pool_buf *buf = qrtr_pool_buf(data);
+
+	__atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+
+	return data;
+}
+
+/**
+ * qrtr_pool_put() - Drop a reference to a pool buffer
+ * @data:	Buffer returned by qrtr_pool_alloc(), or NULL
+ *
+ * When the last reference is dropped the buffer is returned to its pool.
+ */
+void qrtr_pool_put(void *data)
+{
+	struct qrtr_pool_buf *buf;
+	struct qrtr_pool *pool;
+	bool release = false;
+
+	if (!data)
+		return;
+
+	buf = qrtr_pool_buf(data);
+	if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	pool = buf->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	if (buf->class >= 0 && !pool->destroyed &&
+	    pool->nfree[buf->class] < QRTR_POOL_MAX_FREE) {
+		buf->next = pool->free[buf->class];
+		pool->free[buf->class] = buf;
+		pool->nfree[buf->class]++;
+		buf = NULL;
+	}
+	pool->outstanding--;
+	release = pool->destroyed && !pool->outstanding;
+	pthread_mutex_unlock(&pool->lock);
+
+	free(buf);
+
+	if (release)
+		qrtr_pool_free(pool);
+}
+
+size_t qrtr_pool_buf_size(const void *data)
+{
+	return qrtr_pool_buf(data)->size;
+}
+
+/**
+ * qrtr_pending_size() - Get the size of the next pending datagram
+ * @sock:	Socket to peek at
+ *
+ * Return: Size of the next datagram, without consuming it, or negative
+ * errno on failure.
+ */
+ssize_t qrtr_pending_size(int sock)
+{
+	ssize_t len;
+
+	len = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if (len < 0)
+		return -errno;
+
+	return len;
+}
+
+/**
+ * qrtr_recv_pooled() - Receive and decode a datagram into a pool buffer
+ * @sock:	Socket to receive from
+ * @pool:	Pool to allocate the buffer from
+ * @pkt:	Packet to decode the datagram into
+ * @sq:		Updated with the source address, may be NULL
+ *
+ * The size of the pending datagram is peeked first, so the buffer is taken
+ * from the best fitting size class and the datagram isn't truncated. Should
+ * another reader of @sock take the peeked datagram first, a larger one
+ * received in its place is dropped.
+ * On success @pkt->data holds the received datagram, for control messages
+ * as well, and the caller must release it using qrtr_pool_put().
+ *
+ * Return: Length of the received datagram, or negative errno on failure,
+ * -EMSGSIZE when it was dropped as truncated.
+ */
+int qrtr_recv_pooled(int sock, struct qrtr_pool *pool, struct qrtr_packet *pkt,
+		     struct sockaddr_qrtr *sq)
+{
+	struct sockaddr_qrtr tmp;
+	struct msghdr msg = {};
+	struct iovec iov;
+	ssize_t len;
+	void *data;
+	int rc;
+
+	if (!sq)
+		sq = &tmp;
+
+	len = qrtr_pending_size(sock);
+	if (len < 0) {
+		PLOGE("recv(MSG_PEEK)");
+		return len;
+	}
+
+	data = qrtr_pool_alloc(pool, len ? len : 1);
+	if (!data)
+		return -ENOMEM;
+
+	iov.iov_base = data;
+	iov.iov_len = qrtr_pool_buf_size(data);
+	msg.msg_name = sq;
+	msg.msg_namelen = sizeof(*sq);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	len = recvmsg(sock, &msg, 0);
+	if (len < 0) {
+		rc = -errno;
+		PLOGE("recvmsg()");
+		qrtr_pool_put(data);
+		return rc;
+	}
+
+	/* Only if another reader took the peeked datagram */
+	if (msg.msg_flags & MSG_TRUNC) {
+		LOGW("dropping truncated message from %u:%u",
+		     sq->sq_node, sq->sq_port);
+		qrtr_pool_put(data);
+		return -EMSGSIZE;
+	}
+
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->data = data;
+	pkt->data_len = len;
+
+	rc = qrtr_decode(pkt, data, len, sq);
+	if (rc < 0) {
+		qrtr_pool_put(data);
+		pkt->data = NULL;
+		return rc;
+	}
+
+	return len;
+}
+
+#define QRTR_RECV_BATCH_MAX	64
+
+/**
+ * qrtr_recv_batch() - Receive and decode multiple datagrams
+ * @sock:	Socket to receive from
+ * @pool:	Pool to allocate the buffers from
+ * @pkts:	Array of packets to decode the datagrams into
+ * @sqs:	Array updated with the source addresses, may be NULL
+ * @count:	Number of entries in @pkts, and @sqs, at most 64 are received
+ * @flags:	MSG_DONTWAIT not to wait for the first datagram
+ *
+ * Receives up to @count pending datagrams and decodes each into @pkts, like
+ * qrtr_recv_pooled(). Nothing is allocated until a datagram is pending. The
+ * first is peeked and gets a buffer of its size, the others buffers of the
+ * largest size class, which the pool recycles, so none is truncated. They
+ * are then all received by a single recvmmsg(). Datagrams failing to decode
+ * are dropped. The caller must release the @pkts->data of each returned
+ * packet using qrtr_pool_put().
+ *
+ * Return: Number of packets returned, or negative errno on failure. With
+ * MSG_DONTWAIT 0 is returned when nothing is pending.
+ */
+int qrtr_recv_batch(int sock, struct qrtr_pool *pool, struct qrtr_packet *pkts,
+		    struct sockaddr_qrtr *sqs, unsigned int count, int flags)
+{
+	const size_t max_size = qrtr_pool_classes[QRTR_POOL_NCLASSES - 1];
+	struct sockaddr_qrtr tmp[QRTR_RECV_BATCH_MAX];
+	struct mmsghdr msgs[QRTR_RECV_BATCH_MAX];
+	struct iovec iov[QRTR_RECV_BATCH_MAX];
+	void *bufs[QRTR_RECV_BATCH_MAX];
+	unsigned int nbufs = 0;
+	struct msghdr *hdr;
+	unsigned int n = 0;
+	unsigned int i;
+	ssize_t len;
+	int rc;
+
+	if (count > QRTR_RECV_BATCH_MAX)
+		count = QRTR_RECV_BATCH_MAX;
+	if (!count)
+		return 0;
+	if (!sqs)
+		sqs = tmp;
+
+	len = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC | (flags & MSG_DONTWAIT));
+	if (len < 0) {
+		rc = -errno;
+		if (rc == -EAGAIN || rc == -EWOULDBLOCK)
+			return 0;
+
+		PLOGE("recv(MSG_PEEK)");
+		return rc;
+	}
+
+	memset(msgs, 0, count * sizeof(msgs[0]));
+	for (i = 0; i < count; i++) {
+		bufs[i] = qrtr_pool_alloc(pool, i ? max_size : len ? len : 1);
+		if (!bufs[i]) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		nbufs++;
+
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = qrtr_pool_buf_size(bufs[i]);
+
+		hdr = &msgs[i].msg_hdr;
+		hdr->msg_name = &sqs[i];
+		hdr->msg_namelen = sizeof(sqs[i]);
+		hdr->msg_iov = &iov[i];
+		hdr->msg_iovlen = 1;
+	}
+
+	rc = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+	if (rc < 0) {
+		rc = -errno;
+		if (rc == -EAGAIN || rc == -EWOULDBLOCK)
+			rc = 0;
+		else
+			PLOGE("recvmmsg()");
+		goto out;
+	}
+
+	for (i = 0; i < rc; i++) {
+		struct qrtr_packet *pkt = &pkts[n];
+
+		/* Only if another reader took the peeked datagram */
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			LOGW("dropping truncated message from %u:%u",
+			     sqs[i].sq_node, sqs[i].sq_port);
+			continue;
+		}
+
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->data = bufs[i];
+		pkt->data_len = msgs[i].msg_len;
+
+		if (qrtr_decode(pkt, bufs[i], msgs[i].msg_len, &sqs[i]) < 0)
+			continue;
+
+		/* Keep @sqs in line with @pkts */
+		if (n != i)
+			sqs[n] = sqs[i];
+		bufs[i] = NULL;
+		n++;
+	}
+	rc = n;
+
+out:
+	/* Release the buffers not handed out in @pkts */
+	for (i = 0; i < nbufs; i++)
+		qrtr_pool_put(bufs[i]);
+
+	return rc;
+}
@@ -33,8 +33,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include "logging.h"
+#include "probe.h"
 
 /**
  * qmi_header - wireformat header of QMI messages
@@ -102,7 +104,8 @@ static int qmi_encode(struct qmi_elem_info *ei_array, void *out_buf,
 		      int enc_level);
 
 static int qmi_decode(struct qmi_elem_info *ei_array, void *out_c_struct,
-		      const void *in_buf, uint32_t in_buf_len, int dec_level);
+		      const void *in_buf, uint32_t in_buf_len, int dec_level,
+		      struct qmi_arena *arena);
 
 /**
  * skip_to_next_elem() - Skip to next element in the structure to be encoded
@@ -134,6 +137,32 @@ static struct qmi_elem_info *skip_to_next_elem(struct qmi_elem_info *ei_array,
 	return temp_ei;
 }
 
+/**
+ * qmi_elem_src() - Locate the data of an element to be encoded
+ * @ei: Struct info describing the element.
+ * @in_c_struct: Pointer to the C structure being encoded.
+ *
+ * Elements of VAR_LEN_ARRAY_PTR type are stored out of line and the C
+ * structure only holds a pointer to them. A NULL string is encoded as an
+ * empty string.
+ *
+ * Return: Pointer to the element's data, or NULL if it is missing.
+ */
+static const void *qmi_elem_src(const struct qmi_elem_info *ei,
+				const void *in_c_struct)
+{
+	const void *src = (char*)in_c_struct + ei->offset;
+
+	if (ei->array_type != VAR_LEN_ARRAY_PTR)
+		return src;
+
+	memcpy(&src, src, sizeof(src));
+	if (!src && ei->data_type == QMI_STRING)
+		return "";
+
+	return src;
+}
+
 /**
  * qmi_calc_min_msg_len() - Calculate the minimum length of a QMI message
  * @ei_array: Struct info array describing the structure.
@@ -354,10 +383,10 @@ static int qmi_encode(struct qmi_elem_info *ei_array, void *out_buf,
 		buf_dst = buf_dst + (TLV_LEN_SIZE + TLV_TYPE_SIZE);
 
 	while (temp_ei->data_type != QMI_EOTI) {
-		buf_src = (void*)((char*)in_c_struct + temp_ei->offset);
 		tlv_type = temp_ei->tlv_type;
 
-		if (temp_ei->array_type == NO_ARRAY) {
+		if (temp_ei->array_type == NO_ARRAY ||
+		    temp_ei->data_type == QMI_STRING) {
 			data_len_value = 1;
 		} else if (temp_ei->array_type == STATIC_ARRAY) {
 			data_len_value = temp_ei->elem_len;
@@ -367,6 +396,12 @@ static int qmi_encode(struct qmi_elem_info *ei_array, void *out_buf,
 			return -EINVAL;
 		}
 
+		buf_src = qmi_elem_src(temp_ei, in_c_struct);
+		if (!buf_src) {
+			LOGW("%s: NULL data pointer\n", __func__);
+			return -EINVAL;
+		}
+
 		switch (temp_ei->data_type) {
 		case QMI_OPT_FLAG:
 			rc = qmi_encode_basic_elem(&opt_flag_value, buf_src,
@@ -378,6 +413,7 @@ static int qmi_encode(struct qmi_elem_info *ei_array, void *out_buf,
 			break;
 
 		case QMI_DATA_LEN:
+			data_len_value = 0;
 			memcpy(&data_len_value, buf_src, temp_ei->elem_size);
 			data_len_sz = temp_ei->elem_size == sizeof(uint8_t) ?
 					sizeof(uint8_t) : sizeof(uint16_t);
@@ -462,6 +498,311 @@ static int qmi_encode(struct qmi_elem_info *ei_array, void *out_buf,
 	return encoded_bytes;
 }
 
+/**
+ * struct qmi_iov_buf - state of a scatter/gather encode
+ * @buf:	Buffer receiving the QMI header, TLV framing and small elements,
+ *		or NULL to only calculate the size of the encoded message
+ * @buf_len:	Size of @buf
+ * @buf_used:	Number of bytes of @buf consumed so far
+ * @iov:	Array of iovecs describing the encoded message
+ * @iov_max:	Number of entries available in @iov
+ * @iov_cnt:	Number of entries of @iov used so far
+ * @total:	Number of bytes described by @iov
+ */
+struct qmi_iov_buf {
+	uint8_t *buf;
+	size_t buf_len;
+	size_t buf_used;
+
+	struct iovec *iov;
+	int iov_max;
+	int iov_cnt;
+
+	size_t total;
+};
+
+/* Arrays and strings of at least this size are referenced, not copied */
+#define QMI_IOV_REF_THRESHOLD 64
+
+/**
+ * qmi_iov_put() - Append data to a scatter/gather encode
+ * @sg:		Scatter/gather encode state.
+ * @src:	Data to append, or NULL to append zeroes.
+ * @len:	Number of bytes to append.
+ * @may_ref:	Whether @src may be referenced in place, rather than copied.
+ *
+ * Data is copied into the framing buffer, extending the last iovec when
+ * possible. Large blocks are referenced directly by a new iovec if @may_ref
+ * is set, in which case @src must stay valid until the message is sent.
+ * Without a framing buffer only the total size is accounted.
+ *
+ * Return: 0 on success, negative errno if @buf or @iov is exhausted.
+ */
+static int qmi_iov_put(struct qmi_iov_buf *sg, const void *src, size_t len,
+		       int may_ref)
+{
+	struct iovec *last = NULL;
+	uint8_t *dst;
+
+	if (!len)
+		return 0;
+
+	if (!sg->buf) {
+		sg->total += len;
+		return 0;
+	}
+
+	if (may_ref && src && len >= QMI_IOV_REF_THRESHOLD) {
+		if (sg->iov_cnt == sg->iov_max)
+			return -EMSGSIZE;
+
+		sg->iov[sg->iov_cnt].iov_base = (void *)src;
+		sg->iov[sg->iov_cnt].iov_len = len;
+		sg->iov_cnt++;
+		sg->total += len;
+		return 0;
+	}
+
+	if (sg->buf_used + len > sg->buf_len)
+		return -EMSGSIZE;
+
+	dst = sg->buf + sg->buf_used;
+	if (src)
+		memcpy(dst, src, len);
+	else
+		memset(dst, 0, len);
+
+	if (sg->iov_cnt)
+		last = &sg->iov[sg->iov_cnt - 1];
+
+	if (last && (uint8_t *)last->iov_base + last->iov_len == dst) {
+		last->iov_len += len;
+	} else {
+		if (sg->iov_cnt == sg->iov_max)
+			return -EMSGSIZE;
+
+		sg->iov[sg->iov_cnt].iov_base = dst;
+		sg->iov[sg->iov_cnt].iov_len = len;
+		sg->iov_cnt++;
+	}
+
+	sg->buf_used += len;
+	sg->total += len;
+
+	return 0;
+}
+
+/**
+ * qmi_encode_iov() - Scatter/gather variant of qmi_encode()
+ * @ei_array: Struct info array describing the structure to be encoded.
+ * @sg: Scatter/gather encode state to append the encoded data to.
+ * @in_c_struct: Pointer to the C structure to be encoded.
+ * @enc_level: Encode level to indicate the depth of the nested structure,
+ *             within the main structure, being encoded.
+ *
+ * Produces the same wire format as qmi_encode(), but large arrays and
+ * strings are referenced from @in_c_struct rather than copied.
+ *
+ * Return: 0 on success, negative errno on error.
+ */
+static int qmi_encode_iov(struct qmi_elem_info *ei_array,
+			  struct qmi_iov_buf *sg, const void *in_c_struct,
+			  int enc_level)
+{
+	struct qmi_elem_info *temp_ei = ei_array;
+	uint8_t opt_flag_value = 0;
+	uint32_t data_len_value = 0, data_len_sz;
+	uint32_t string_len, string_len_sz;
+	size_t tlv_start = 0;
+	size_t tlv_off = 0;
+	int tlv_open = 0;
+	const void *buf_src;
+	uint32_t tlv_len;
+	uint8_t tlv_type;
+	int encode_tlv;
+	uint32_t i;
+	int rc;
+
+	if (!ei_array)
+		return 0;
+
+	while (temp_ei->data_type != QMI_EOTI) {
+		tlv_type = temp_ei->tlv_type;
+		encode_tlv = 0;
+
+		if (temp_ei->array_type == NO_ARRAY ||
+		    temp_ei->data_type == QMI_STRING) {
+			data_len_value = 1;
+		} else if (temp_ei->array_type == STATIC_ARRAY) {
+			data_len_value = temp_ei->elem_len;
+		} else if (data_len_value <= 0 ||
+			    temp_ei->elem_len < data_len_value) {
+			LOGW("%s: Invalid data length\n", __func__);
+			return -EINVAL;
+		}
+
+		buf_src = qmi_elem_src(temp_ei, in_c_struct);
+		if (!buf_src) {
+			LOGW("%s: NULL data pointer\n", __func__);
+			return -EINVAL;
+		}
+
+		/* Reserve room for the TLV header, filled in once complete */
+		if (enc_level == 1 && !tlv_open &&
+		    temp_ei->data_type != QMI_OPT_FLAG) {
+			tlv_off = sg->buf_used;
+			rc = qmi_iov_put(sg, NULL, TLV_TYPE_SIZE + TLV_LEN_SIZE, 0);
+			if (rc < 0)
+				return rc;
+			tlv_start = sg->total;
+			tlv_open = 1;
+		}
+
+		switch (temp_ei->data_type) {
+		case QMI_OPT_FLAG:
+			memcpy(&opt_flag_value, buf_src, sizeof(uint8_t));
+			if (opt_flag_value)
+				temp_ei = temp_ei + 1;
+			else
+				temp_ei = skip_to_next_elem(temp_ei, enc_level);
+			break;
+
+		case QMI_DATA_LEN:
+			data_len_value = 0;
+			memcpy(&data_len_value, buf_src, temp_ei->elem_size);
+			data_len_sz = temp_ei->elem_size == sizeof(uint8_t) ?
+					sizeof(uint8_t) : sizeof(uint16_t);
+			rc = qmi_iov_put(sg, &data_len_value, data_len_sz, 0);
+			if (rc < 0)
+				return rc;
+			temp_ei = temp_ei + 1;
+			if (!data_len_value) {
+				temp_ei = skip_to_next_elem(temp_ei, enc_level);
+				encode_tlv = 1;
+			}
+			break;
+
+		case QMI_UNSIGNED_1_BYTE:
+		case QMI_UNSIGNED_2_BYTE:
+		case QMI_UNSIGNED_4_BYTE:
+		case QMI_UNSIGNED_8_BYTE:
+		case QMI_SIGNED_1_BYTE_ENUM:
+		case QMI_SIGNED_2_BYTE_ENUM:
+		case QMI_SIGNED_4_BYTE_ENUM:
+			rc = qmi_iov_put(sg, buf_src,
+					 data_len_value * temp_ei->elem_size, 1);
+			if (rc < 0)
+				return rc;
+			temp_ei = temp_ei + 1;
+			encode_tlv = 1;
+			break;
+
+		case QMI_STRUCT:
+			for (i = 0; i < data_len_value; i++) {
+				rc = qmi_encode_iov(temp_ei->ei_array, sg,
+						    buf_src, enc_level + 1);
+				if (rc < 0)
+					return rc;
+				buf_src = (void*)((char*)buf_src + temp_ei->elem_size);
+			}
+			temp_ei = temp_ei + 1;
+			encode_tlv = 1;
+			break;
+
+		case QMI_STRING:
+			string_len = strlen(buf_src);
+			string_len_sz = temp_ei->elem_len <= 256 ?
+					sizeof(uint8_t) : sizeof(uint16_t);
+			if (string_len > temp_ei->elem_len) {
+				LOGW("%s: String to be encoded is longer - %u > %u\n",
+				     __func__, string_len, temp_ei->elem_len);
+				return -EINVAL;
+			}
+
+			if (enc_level > 1) {
+				rc = qmi_iov_put(sg, &string_len,
+						 string_len_sz, 0);
+				if (rc < 0)
+					return rc;
+			}
+
+			rc = qmi_iov_put(sg, buf_src,
+					 string_len * temp_ei->elem_size, 1);
+			if (rc < 0)
+				return rc;
+			temp_ei = temp_ei + 1;
+			encode_tlv = 1;
+			break;
+
+		default:
+			LOGW("%s: Unrecognized data type\n", __func__);
+			return -EINVAL;
+		}
+
+		if (encode_tlv && enc_level == 1) {
+			tlv_len = sg->total - tlv_start;
+			if (sg->buf) {
+				sg->buf[tlv_off] = tlv_type;
+				sg->buf[tlv_off + 1] = tlv_len & 0xff;
+				sg->buf[tlv_off + 2] = (tlv_len >> 8) & 0xff;
+			}
+			tlv_open = 0;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * qmi_arena_alloc() - Allocate out-of-line storage for decoded data
+ * @arena: Arena to allocate from, may be NULL.
+ * @size: Number of bytes to allocate.
+ *
+ * Return: Pointer to @size bytes of pointer-aligned memory, or NULL if the
+ * arena is missing or exhausted.
+ */
+static void *qmi_arena_alloc(struct qmi_arena *arena, size_t size)
+{
+	size_t align = sizeof(void *);
+	size_t offset;
+
+	if (!arena) {
+		LOGW("%s: out-of-line element without arena\n", __func__);
+		return NULL;
+	}
+
+	offset = (arena->used + align - 1) & ~(align - 1);
+	if (offset > arena->size || size > arena->size - offset) {
+		LOGW("%s: arena exhausted\n", __func__);
+		return NULL;
+	}
+
+	arena->used = offset + size;
+
+	return (char *)arena->base + offset;
+}
+
+/**
+ * qmi_decode_ptr() - Redirect decoding of an element into the arena
+ * @arena: Arena to allocate from.
+ * @buf_dst: Location of the element's pointer in the C structure.
+ * @size: Number of bytes to allocate.
+ *
+ * Return: Pointer to the allocated storage, which has been stored in
+ * @buf_dst, or NULL on failure.
+ */
+static void *qmi_decode_ptr(struct qmi_arena *arena, void *buf_dst,
+			    size_t size)
+{
+	void *ptr;
+
+	ptr = qmi_arena_alloc(arena, size);
+	if (ptr)
+		memcpy(buf_dst, &ptr, sizeof(ptr));
+
+	return ptr;
+}
+
 /**
  * qmi_decode_basic_elem() - Decodes elements of basic/primary data type
  * @buf_dst: Buffer to store the decoded element.
@@ -499,6 +840,7 @@ static int qmi_decode_basic_elem(void *buf_dst, const void *buf_src,
  * @tlv_len: Total size of the encoded inforation corresponding to
  *           this struct element.
  * @dec_level: Depth of the nested structure from the main structure.
+ * @arena: Arena for out-of-line elements, may be NULL.
  *
  * This function decodes the "elem_len" number of elements in QMI wire format,
  * each of size "(tlv_len/elem_len)" bytes from the source buffer "buf_src"
@@ -512,14 +854,14 @@ static int qmi_decode_basic_elem(void *buf_dst, const void *buf_src,
 static int qmi_decode_struct_elem(struct qmi_elem_info *ei_array,
 				  void *buf_dst, const void *buf_src,
 				  uint32_t elem_len, uint32_t tlv_len,
-				  int dec_level)
+				  int dec_level, struct qmi_arena *arena)
 {
 	int i, rc, decoded_bytes = 0;
 	struct qmi_elem_info *temp_ei = ei_array;
 
 	for (i = 0; i < elem_len && decoded_bytes < tlv_len; i++) {
 		rc = qmi_decode(temp_ei->ei_array, buf_dst, buf_src,
-				tlv_len - decoded_bytes, dec_level);
+				tlv_len - decoded_bytes, dec_level, arena);
 		if (rc < 0)
 			return rc;
 		buf_src = (void*)((char*)buf_src + rc);
@@ -546,18 +888,20 @@ static int qmi_decode_struct_elem(struct qmi_elem_info *ei_array,
  * @tlv_len: Total size of the encoded inforation corresponding to
  *           this string element.
  * @dec_level: Depth of the string element from the main structure.
+ * @arena: Arena for out-of-line strings, may be NULL.
  *
  * This function decodes the string element of maximum length
  * "ei_array->elem_len" from the source buffer "buf_src" and puts it into
- * the destination buffer "buf_dst". This function returns number of bytes
- * decoded from the input buffer.
+ * the destination buffer "buf_dst", or into @arena for out-of-line strings.
+ * This function returns number of bytes decoded from the input buffer.
  *
  * Return: The total size of the decoded data elements on success, negative
  * errno on error.
  */
 static int qmi_decode_string_elem(struct qmi_elem_info *ei_array,
 				  void *buf_dst, const void *buf_src,
-				  uint32_t tlv_len, int dec_level)
+				  uint32_t tlv_len, int dec_level,
+				  struct qmi_arena *arena)
 {
 	int rc;
 	int decoded_bytes = 0;
@@ -585,6 +929,13 @@ static int qmi_decode_string_elem(struct qmi_elem_info *ei_array,
 		return -EFAULT;
 	}
 
+	if (temp_ei->array_type == VAR_LEN_ARRAY_PTR) {
+		buf_dst = qmi_decode_ptr(arena, buf_dst,
+					 (string_len + 1) * temp_ei->elem_size);
+		if (!buf_dst)
+			return -ENOMEM;
+	}
+
 	rc = qmi_decode_basic_elem(buf_dst, (void*)((char*)buf_src + decoded_bytes),
 				   string_len, temp_ei->elem_size);
 	*((char *)buf_dst + string_len) = '\0';
@@ -627,13 +978,14 @@ static struct qmi_elem_info *find_ei(struct qmi_elem_info *ei_array,
  * @in_buf_len: Length of the QMI message to be decoded
  * @dec_level: Decode level to indicate the depth of the nested structure,
  *             within the main structure, being decoded
+ * @arena: Arena for out-of-line elements, may be NULL
  *
  * Return: The number of bytes of decoded information on success, negative
  * errno on error.
  */
 static int qmi_decode(struct qmi_elem_info *ei_array, void *out_c_struct,
 		      const void *in_buf, uint32_t in_buf_len,
-		      int dec_level)
+		      int dec_level, struct qmi_arena *arena)
 {
 	struct qmi_elem_info *temp_ei = ei_array;
 	uint8_t opt_flag_value = 1;
@@ -683,6 +1035,7 @@ static int qmi_decode(struct qmi_elem_info *ei_array, void *out_c_struct,
 		if (temp_ei->data_type == QMI_DATA_LEN) {
 			data_len_sz = temp_ei->elem_size == sizeof(uint8_t) ?
 					sizeof(uint8_t) : sizeof(uint16_t);
+			data_len_value = 0;
 			rc = qmi_decode_basic_elem(&data_len_value, buf_src,
 						   1, data_len_sz);
 			memcpy(buf_dst, &data_len_value, sizeof(uint32_t));
@@ -692,7 +1045,8 @@ static int qmi_decode(struct qmi_elem_info *ei_array, void *out_c_struct,
 			UPDATE_DECODE_VARIABLES(buf_src, decoded_bytes, rc);
 		}
 
-		if (temp_ei->array_type == NO_ARRAY) {
+		if (temp_ei->array_type == NO_ARRAY ||
+		    temp_ei->data_type == QMI_STRING) {
 			data_len_value = 1;
 		} else if (temp_ei->array_type == STATIC_ARRAY) {
 			data_len_value = temp_ei->elem_len;
@@ -702,6 +1056,14 @@ static int qmi_decode(struct qmi_elem_info *ei_array, void *out_c_struct,
 			return -EINVAL;
 		}
 
+		if (temp_ei->array_type == VAR_LEN_ARRAY_PTR &&
+		    temp_ei->data_type != QMI_STRING) {
+			buf_dst = qmi_decode_ptr(arena, buf_dst,
+						 data_len_value * temp_ei->elem_size);
+			if (!buf_dst)
+				return -ENOMEM;
+		}
+
 		switch (temp_ei->data_type) {
 		case QMI_UNSIGNED_1_BYTE:
 		case QMI_UNSIGNED_2_BYTE:
@@ -719,7 +1081,7 @@ static int qmi_decode(struct qmi_elem_info *ei_array, void *out_c_struct,
 		case QMI_STRUCT:
 			rc = qmi_decode_struct_elem(temp_ei, buf_dst, buf_src,
 						    data_len_value, tlv_len,
-						    dec_level + 1);
+						    dec_level + 1, arena);
 			if (rc < 0)
 				return rc;
 			UPDATE_DECODE_VARIABLES(buf_src, decoded_bytes, rc);
@@ -727,7 +1089,7 @@ static int qmi_decode(struct qmi_elem_info *ei_array, void *out_c_struct,
 
 		case QMI_STRING:
 			rc = qmi_decode_string_elem(temp_ei, buf_dst, buf_src,
-						    tlv_len, dec_level);
+						    tlv_len, dec_level, arena);
 			if (rc < 0)
 				return rc;
 			UPDATE_DECODE_VARIABLES(buf_src, decoded_bytes, rc);
@@ -760,27 +1122,35 @@ ssize_t qmi_encode_message(struct qrtr_packet *pkt, int type, int msg_id,
 {
 	struct qmi_header *hdr = pkt->data;
 	ssize_t msglen = 0;
+	ssize_t rc;
 	int ret;
 
+	QRTR_PROBE(qmi_encode_entry, type, msg_id, txn_id);
+
 	/* Check the possibility of a zero length QMI message */
 	if (!c_struct) {
 		ret = qmi_calc_min_msg_len(ei, 1);
 		if (ret) {
 			LOGW("%s: Calc. len %d != 0, but NULL c_struct\n",
 			     __func__, ret);
-			return -EINVAL;
+			rc = -EINVAL;
+			goto out;
 		}
 	}
 
-	if (pkt->data_len < sizeof(*hdr))
-		return -EMSGSIZE;
+	if (pkt->data_len < sizeof(*hdr)) {
+		rc = -EMSGSIZE;
+		goto out;
+	}
 
 	/* Encode message, if we have a message */
 	if (c_struct) {
 		msglen = qmi_encode(ei, (void*)((char*)pkt->data + sizeof(*hdr)), c_struct,
 				    pkt->data_len - sizeof(*hdr), 1);
-		if (msglen < 0)
-			return msglen;
+		if (msglen < 0) {
+			rc = msglen;
+			goto out;
+		}
 	}
 
 	hdr->type = type;
@@ -790,8 +1160,243 @@ ssize_t qmi_encode_message(struct qrtr_packet *pkt, int type, int msg_id,
 
 	pkt->type = QRTR_TYPE_DATA;
 	pkt->data_len = sizeof(*hdr) + msglen;
+	rc = pkt->data_len;
 
-	return pkt->data_len;
+out:
+	QRTR_PROBE(qmi_encode_exit, type, msg_id, rc);
+	return rc;
+}
+
+/**
+ * qmi_encoded_size() - Calculate the size of an encoded QMI message
+ * @c_struct:	Reference to structure to encode, may be NULL
+ * @ei:		QMI message descriptor
+ *
+ * Walks @ei against @c_struct the same way qmi_encode_message() does,
+ * without producing any output.
+ *
+ * Return: Exact size of the encoded message, including the QMI header, or
+ * negative errno if @c_struct can't be encoded.
+ */
+ssize_t qmi_encoded_size(const void *c_struct, struct qmi_elem_info *ei)
+{
+	struct qmi_iov_buf sg = {};
+	int ret;
+
+	if (!c_struct) {
+		ret = qmi_calc_min_msg_len(ei, 1);
+		if (ret) {
+			LOGW("%s: Calc. len %d != 0, but NULL c_struct\n",
+			     __func__, ret);
+			return -EINVAL;
+		}
+
+		return sizeof(struct qmi_header);
+	}
+
+	ret = qmi_encode_iov(ei, &sg, c_struct, 1);
+	if (ret < 0)
+		return ret;
+
+	return sizeof(struct qmi_header) + sg.total;
+}
+
+/**
+ * qmi_encode_message_alloc() - Encode C structure into a growable buffer
+ * @pkt:	Packet to encode into, @pkt->data may be NULL
+ * @size:	Passed as allocated size of @pkt->data, updated on growth
+ * @type:	Type of QMI message
+ * @msg_id:	Message ID of the message
+ * @txn_id:	Transaction ID
+ * @c_struct:	Reference to structure to encode
+ * @ei:		QMI message descriptor
+ *
+ * The exact size of the message is calculated up front and @pkt->data is
+ * grown with realloc() when it is too small, so a single buffer can be
+ * reused for all messages of a service. The caller owns, and eventually
+ * frees, @pkt->data. Use qmi_encode_message_pool() for a buffer from a
+ * struct qrtr_pool, e.g. when it is still referenced after sending.
+ *
+ * Return: Length of the encoded message, or negative errno on error.
+ */
+ssize_t qmi_encode_message_alloc(struct qrtr_packet *pkt, size_t *size,
+				 int type, int msg_id, int txn_id,
+				 const void *c_struct, struct qmi_elem_info *ei)
+{
+	ssize_t len;
+	void *data;
+
+	len = qmi_encoded_size(c_struct, ei);
+	if (len < 0)
+		return len;
+
+	if (!pkt->data || *size < len) {
+		data = realloc(pkt->data, len);
+		if (!data)
+			return -ENOMEM;
+
+		pkt->data = data;
+		*size = len;
+	}
+
+	pkt->data_len = *size;
+
+	return qmi_encode_message(pkt, type, msg_id, txn_id, c_struct, ei);
+}
+
+/**
+ * qmi_encode_message_pool() - Encode C structure into a pool buffer
+ * @pool:	Pool to allocate the buffer from
+ * @pkt:	Packet to encode into, @pkt->data is overwritten
+ * @type:	Type of QMI message
+ * @msg_id:	Message ID of the message
+ * @txn_id:	Transaction ID
+ * @c_struct:	Reference to structure to encode
+ * @ei:		QMI message descriptor
+ *
+ * On success the caller must release @pkt->data using qrtr_pool_put().
+ *
+ * Return: Length of the encoded message, or negative errno on error.
+ */
+ssize_t qmi_encode_message_pool(struct qrtr_pool *pool, struct qrtr_packet *pkt,
+				int type, int msg_id, int txn_id,
+				const void *c_struct, struct qmi_elem_info *ei)
+{
+	ssize_t len;
+
+	len = qmi_encoded_size(c_struct, ei);
+	if (len < 0)
+		return len;
+
+	pkt->data = qrtr_pool_alloc(pool, len);
+	if (!pkt->data)
+		return -ENOMEM;
+	pkt->data_len = len;
+
+	len = qmi_encode_message(pkt, type, msg_id, txn_id, c_struct, ei);
+	if (len < 0) {
+		qrtr_pool_put(pkt->data);
+		pkt->data = NULL;
+	}
+
+	return len;
+}
+
+/**
+ * qmi_encode_message_iov() - Encode C structure as scatter/gather QMI message
+ * @iov:	Array of iovecs to describe the encoded message
+ * @iovcnt:	Passed as number of entries in @iov, updated to number used
+ * @buf:	Buffer for the QMI header, TLV framing and small elements
+ * @buf_len:	Size of @buf
+ * @type:	Type of QMI message
+ * @msg_id:	Message ID of the message
+ * @txn_id:	Transaction ID
+ * @c_struct:	Reference to structure to encode
+ * @ei:		QMI message descriptor
+ *
+ * Unlike qmi_encode_message() large arrays and strings are not copied, the
+ * resulting @iov references them in @c_struct, which must therefore remain
+ * valid until the message has been sent, e.g. using qrtr_sendmsg_iov().
+ *
+ * Return: Total length of the encoded message, or negative errno on error.
+ */
+ssize_t qmi_encode_message_iov(struct iovec *iov, int *iovcnt,
+			       void *buf, size_t buf_len,
+			       int type, int msg_id, int txn_id,
+			       const void *c_struct, struct qmi_elem_info *ei)
+{
+	struct qmi_iov_buf sg = {
+		.buf = buf,
+		.buf_len = buf_len,
+		.iov = iov,
+		.iov_max = *iovcnt,
+	};
+	struct qmi_header *hdr = buf;
+	int ret;
+
+	/* Check the possibility of a zero length QMI message */
+	if (!c_struct) {
+		ret = qmi_calc_min_msg_len(ei, 1);
+		if (ret) {
+			LOGW("%s: Calc. len %d != 0, but NULL c_struct\n",
+			     __func__, ret);
+			return -EINVAL;
+		}
+	}
+
+	ret = qmi_iov_put(&sg, NULL, sizeof(*hdr), 0);
+	if (ret < 0)
+		return ret;
+
+	/* Encode message, if we have a message */
+	if (c_struct) {
+		ret = qmi_encode_iov(ei, &sg, c_struct, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	hdr->type = type;
+	hdr->txn_id = txn_id;
+	hdr->msg_id = msg_id;
+	hdr->msg_len = sg.total - sizeof(*hdr);
+
+	*iovcnt = sg.iov_cnt;
+
+	return sg.total;
+}
+
+/**
+ * qmi_send_indication_many() - Encode an indication once, send it to many
+ * @sock:	Socket to send from
+ * @dests:	Destinations, each with its transaction id, updated with the
+ *		result of the send to each
+ * @count:	Number of entries in @dests
+ * @msg_id:	Message ID of the indication
+ * @c_struct:	Reference to structure to encode
+ * @ei:		QMI message descriptor
+ *
+ * The message is encoded only once. Only the transaction id in the header
+ * is patched between consecutive destinations that use different ids.
+ * Destinations are sent to in batches using qrtr_sendto_many().
+ *
+ * Return: Number of destinations the indication was sent to, or negative
+ * errno if the message could not be encoded.
+ */
+int qmi_send_indication_many(int sock, struct qrtr_dest *dests,
+			     unsigned int count, int msg_id,
+			     const void *c_struct, struct qmi_elem_info *ei)
+{
+	struct qrtr_packet pkt = {};
+	struct qmi_header *hdr;
+	size_t size = 0;
+	unsigned int i, j;
+	ssize_t len;
+	int sent = 0;
+
+	if (!count)
+		return 0;
+
+	len = qmi_encode_message_alloc(&pkt, &size, QMI_INDICATION, msg_id,
+				       dests[0].txn_id, c_struct, ei);
+	if (len < 0) {
+		free(pkt.data);
+		return len;
+	}
+
+	hdr = pkt.data;
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count; j++) {
+			if (dests[j].txn_id != dests[i].txn_id)
+				break;
+		}
+
+		hdr->txn_id = dests[i].txn_id;
+		sent += qrtr_sendto_many(sock, dests + i, j - i, pkt.data, len);
+	}
+
+	free(pkt.data);
+
+	return sent;
 }
 
 int qmi_decode_header(const struct qrtr_packet *pkt, unsigned int *msg_id)
@@ -808,6 +1413,82 @@ int qmi_decode_header(const struct qrtr_packet *pkt, unsigned int *msg_id)
 	return 0;
 }
 
+/**
+ * qmi_arena_init() - Initialize an arena for out-of-line elements
+ * @arena:	Arena to initialize
+ * @buf:	Memory backing the arena, owned by the caller
+ * @size:	Size of @buf
+ */
+void qmi_arena_init(struct qmi_arena *arena, void *buf, size_t size)
+{
+	arena->base = buf;
+	arena->size = size;
+	arena->used = 0;
+}
+
+/**
+ * qmi_arena_reset() - Release everything allocated from an arena
+ * @arena:	Arena to reset
+ *
+ * The elements of messages previously decoded into @arena must no longer be
+ * referenced.
+ */
+void qmi_arena_reset(struct qmi_arena *arena)
+{
+	arena->used = 0;
+}
+
+/**
+ * qmi_decode_message_arena() - Decode QMI message using an arena
+ * @c_struct:	Reference to structure to decode into
+ * @txn:	Updated with the transaction id of the message, may be NULL
+ * @pkt:	Packet holding the encoded message
+ * @type:	Expected type of QMI message
+ * @id:		Expected message ID
+ * @ei:		QMI message descriptor
+ * @arena:	Arena holding out-of-line elements of the decoded message, may
+ *		be NULL if @ei describes none
+ *
+ * Same as qmi_decode_message(), but elements described as
+ * VAR_LEN_ARRAY_PTR are stored in @arena, at their actual size, and only
+ * a pointer to them is stored in @c_struct. The arena is not reset, allowing
+ * multiple messages to share it.
+ *
+ * Return: The number of bytes of decoded information on success, negative
+ * errno on error.
+ */
+int qmi_decode_message_arena(void *c_struct, unsigned int *txn,
+			     const struct qrtr_packet *pkt,
+			     int type, int id, struct qmi_elem_info *ei,
+			     struct qmi_arena *arena)
+{
+	const struct qmi_header *hdr = pkt->data;
+	int rc = -EINVAL;
+
+	QRTR_PROBE(qmi_decode_entry, type, id, pkt->data_len);
+
+	if (!ei)
+		goto out;
+
+	if (!c_struct || !pkt->data || pkt->data_len < sizeof(*hdr))
+		goto out;
+
+	if (hdr->type != type)
+		goto out;
+
+	if (hdr->msg_id != id)
+		goto out;
+
+	if (txn)
+		*txn = hdr->txn_id;
+
+	rc = qmi_decode(ei, c_struct, (char *)pkt->data + sizeof(*hdr),
+			pkt->data_len - sizeof(*hdr), 1, arena);
+out:
+	QRTR_PROBE(qmi_decode_exit, type, id, rc);
+	return rc;
+}
+
 /**
  * qmi_decode_message() - Decode QMI encoded message to C structure
  * @buf:	Buffer with encoded message
@@ -815,31 +1496,126 @@ int qmi_decode_header(const struct qrtr_packet *pkt, unsigned int *msg_id)
  * @ei:		QMI message descriptor
  * @c_struct:	Reference to structure to decode into
  *
+ * Elements described as VAR_LEN_ARRAY_PTR are rejected, as there is no
+ * arena to decode them into, see qmi_decode_message_arena().
+ *
  * Return: The number of bytes of decoded information on success, negative
  * errno on error.
  */
 int qmi_decode_message(void *c_struct, unsigned int *txn,
 		       const struct qrtr_packet *pkt,
 		       int type, int id, struct qmi_elem_info *ei)
+{
+	return qmi_decode_message_arena(c_struct, txn, pkt, type, id, ei, NULL);
+}
+
+/**
+ * qmi_tlv_iter_init() - Prepare iteration over the TLVs of a QMI message
+ * @iter:	Iterator to initialize
+ * @pkt:	Packet holding the encoded message
+ *
+ * Return: 0 on success, negative errno if @pkt isn't a valid QMI message.
+ */
+int qmi_tlv_iter_init(struct qmi_tlv_iter *iter, const struct qrtr_packet *pkt)
 {
 	const struct qmi_header *hdr = pkt->data;
 
-	if (!ei)
+	if (!pkt->data || pkt->data_len < sizeof(*hdr))
 		return -EINVAL;
 
-	if (!c_struct || !pkt->data || !pkt->data_len)
+	if (hdr->msg_len > pkt->data_len - sizeof(*hdr))
 		return -EINVAL;
 
-	if (hdr->type != type)
+	iter->pos = (const uint8_t *)pkt->data + sizeof(*hdr);
+	iter->end = iter->pos + hdr->msg_len;
+	iter->tlv = NULL;
+	iter->type = 0;
+	iter->len = 0;
+	iter->value = NULL;
+
+	return 0;
+}
+
+/**
+ * qmi_tlv_iter_next() - Advance to the next TLV of a QMI message
+ * @iter:	Iterator, as prepared by qmi_tlv_iter_init()
+ *
+ * On success @iter describes the type, length and location of the value of
+ * the TLV; nothing is copied or decoded.
+ *
+ * Return: 1 if a TLV was found, 0 at the end of the message, negative errno
+ * if the message is malformed.
+ */
+int qmi_tlv_iter_next(struct qmi_tlv_iter *iter)
+{
+	const uint8_t *p = iter->pos;
+	uint32_t type;
+	uint32_t len;
+
+	if (p == iter->end)
+		return 0;
+
+	if (iter->end - p < TLV_TYPE_SIZE + TLV_LEN_SIZE)
 		return -EINVAL;
 
-	if (hdr->msg_id != id)
+	iter->tlv = p;
+	QMI_ENCDEC_DECODE_TLV(&type, &len, p);
+	p++;
+
+	if (len > iter->end - p)
 		return -EINVAL;
 
-	if (txn)
-		*txn = hdr->txn_id;
+	iter->type = type;
+	iter->len = len;
+	iter->value = p;
+	iter->pos = p + len;
+
+	return 1;
+}
+
+/**
+ * qmi_tlv_iter_find() - Advance to the next TLV of a given type
+ * @iter:	Iterator, as prepared by qmi_tlv_iter_init()
+ * @type:	TLV type to look for
+ *
+ * Return: 1 if a TLV was found, 0 if not, negative errno if the message is
+ * malformed.
+ */
+int qmi_tlv_iter_find(struct qmi_tlv_iter *iter, uint8_t type)
+{
+	int rc;
+
+	while ((rc = qmi_tlv_iter_next(iter)) > 0) {
+		if (iter->type == type)
+			break;
+	}
+
+	return rc;
+}
+
+/**
+ * qmi_tlv_decode() - Decode the current TLV of an iterator
+ * @iter:	Iterator positioned at the TLV to decode
+ * @c_struct:	Reference to structure of the message to decode into
+ * @ei:		QMI message descriptor
+ *
+ * Only the element(s) of @c_struct described by the TLV's entries in @ei,
+ * including any associated optional flag, are written.
+ *
+ * Return: The number of bytes of decoded information on success, negative
+ * errno on error.
+ */
+int qmi_tlv_decode(const struct qmi_tlv_iter *iter, void *c_struct,
+		   struct qmi_elem_info *ei)
+{
+	if (!iter->tlv || !ei || !c_struct)
+		return -EINVAL;
+
+	if (!find_ei(ei, iter->type))
+		return -ENOENT;
 
-	return qmi_decode(ei, c_struct, (void*)((char*)pkt->data + sizeof(*hdr)), pkt->data_len - sizeof(*hdr), 1);
+	return qmi_decode(ei, c_struct, iter->tlv,
+			  TLV_TYPE_SIZE + TLV_LEN_SIZE + iter->len, 1, NULL);
 }
 
 /* Common header in all QMI responses */
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <libqrtr.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logging.h"
+
+#define QMI_SERVICE_BATCH	8
+
+struct qmi_service {
+	int sock;
+
+	uint32_t service;
+	uint16_t version;
+	uint16_t instance;
+
+	/* Indexed by msg_id, for O(1) dispatch */
+	const struct qmi_msg_handler **table;
+	unsigned int table_len;
+
+	void (*disconnect)(struct qmi_service *svc, unsigned int node,
+			   unsigned int port);
+	void *data;
+
+	/* Reused for every request */
+	void *req;
+	void *resp;
+	struct qrtr_packet resp_pkt;
+	size_t resp_size;
+
+	struct qrtr_pool *rx_pool;
+	struct sockaddr_qrtr rx_sq[QMI_SERVICE_BATCH];
+	struct qrtr_packet rx_pkts[QMI_SERVICE_BATCH];
+};
+
+/**
+ * qmi_service_create() - Create and publish a QMI service
+ * @service:	Service id to publish
+ * @version:	Version of the service
+ * @instance:	Instance of the service
+ * @handlers:	Handlers of the requests supported by the service
+ * @count:	Number of entries in @handlers
+ * @data:	Private data of the service, see qmi_service_data()
+ *
+ * @handlers is referenced, not copied, and must outlive the service. Each
+ * msg_id, at most 0xffff, may be handled only once.
+ *
+ * Return: The new service, or NULL on failure.
+ */
+struct qmi_service *qmi_service_create(uint32_t service, uint16_t version,
+				       uint16_t instance,
+				       const struct qmi_msg_handler *handlers,
+				       unsigned int count, void *data)
+{
+	struct qmi_service *svc;
+	size_t req_size = 0;
+	size_t resp_size = 0;
+	unsigned int i;
+
+	svc = calloc(1, sizeof(*svc));
+	if (!svc)
+		return NULL;
+
+	svc->service = service;
+	svc->version = version;
+	svc->instance = instance;
+	svc->data = data;
+	svc->sock = -1;
+
+	for (i = 0; i < count; i++) {
+		/* msg_id is 16 bits on the wire */
+		if (handlers[i].msg_id > 0xffff) {
+			LOGE("invalid QMI message id %#x", handlers[i].msg_id);
+			goto err;
+		}
+		if (handlers[i].msg_id >= svc->table_len)
+			svc->table_len = handlers[i].msg_id + 1;
+		if (handlers[i].req_size > req_size)
+			req_size = handlers[i].req_size;
+		if (handlers[i].resp_size > resp_size)
+			resp_size = handlers[i].resp_size;
+	}
+
+	/* A service may start without any handler */
+	svc->table = calloc(svc->table_len ? svc->table_len : 1,
+			    sizeof(*svc->table));
+	svc->req = calloc(1, req_size ? req_size : 1);
+	svc->resp = calloc(1, resp_size ? resp_size : 1);
+	svc->rx_pool = qrtr_pool_create();
+	if (!svc->table || !svc->req || !svc->resp || !svc->rx_pool)
+		goto err;
+
+	for (i = 0; i < count; i++) {
+		if (svc->table[handlers[i].msg_id]) {
+			LOGE("duplicate handler of QMI message %#x",
+			     handlers[i].msg_id);
+			goto err;
+		}
+		svc->table[handlers[i].msg_id] = &handlers[i];
+	}
+
+	svc->sock = qrtr_open(0);
+	if (svc->sock < 0)
+		goto err;
+
+	if (qrtr_publish(svc->sock, service, version, instance) < 0)
+		goto err;
+
+	return svc;
+
+err:
+	qmi_service_destroy(svc);
+	return NULL;
+}
+
+void qmi_service_destroy(struct qmi_service *svc)
+{
+	if (svc->sock >= 0) {
+		qrtr_bye(svc->sock, svc->service, svc->version, svc->instance);
+		qrtr_close(svc->sock);
+	}
+
+	if (svc->rx_pool)
+		qrtr_pool_destroy(svc->rx_pool);
+	free(svc->resp_pkt.data);
+	free(svc->resp);
+	free(svc->req);
+	free(svc->table);
+	free(svc);
+}
+
+int qmi_service_fd(struct qmi_service *svc)
+{
+	return svc->sock;
+}
+
+void *qmi_service_data(struct qmi_service *svc)
+{
+	return svc->data;
+}
+
+void qmi_service_set_disconnect(struct qmi_service *svc,
+				void (*fn)(struct qmi_service *svc,
+					   unsigned int node,
+					   unsigned int port))
+{
+	svc->disconnect = fn;
+}
+
+static void qmi_service_handle_request(struct qmi_service *svc,
+				       const struct sockaddr_qrtr *sq,
+				       const struct qrtr_packet *pkt)
+{
+	const struct qmi_msg_handler *handler = NULL;
+	unsigned int msg_id;
+	unsigned int txn;
+	ssize_t len;
+	int rc;
+
+	rc = qmi_decode_header(pkt, &msg_id);
+	if (rc < 0)
+		return;
+
+	if (msg_id < svc->table_len)
+		handler = svc->table[msg_id];
+	if (!handler) {
+		LOGW("unhandled QMI message %#x from %u:%u",
+		     msg_id, sq->sq_node, sq->sq_port);
+		return;
+	}
+
+	memset(svc->req, 0, handler->req_size);
+	rc = qmi_decode_message(svc->req, &txn, pkt, QMI_REQUEST, msg_id,
+				handler->req_ei);
+	if (rc < 0) {
+		LOGW("unable to decode QMI message %#x from %u:%u",
+		     msg_id, sq->sq_node, sq->sq_port);
+		return;
+	}
+
+	memset(svc->resp, 0, handler->resp_size);
+	rc = handler->fn(svc, sq->sq_node, sq->sq_port, svc->req, svc->resp);
+	if (rc < 0 || !handler->resp_ei)
+		return;
+
+	len = qmi_encode_message_alloc(&svc->resp_pkt, &svc->resp_size,
+				       QMI_RESPONSE, msg_id, txn, svc->resp,
+				       handler->resp_ei);
+	if (len < 0) {
+		LOGW("unable to encode QMI response %#x", msg_id);
+		return;
+	}
+
+	if (qrtr_sendto(svc->sock, sq->sq_node, sq->sq_port,
+			svc->resp_pkt.data, len) < 0)
+		LOGW("unable to send QMI response %#x to %u:%u", msg_id,
+		     sq->sq_node, sq->sq_port);
+}
+
+/**
+ * qmi_service_process() - Handle pending requests of a QMI service
+ * @svc:	QMI service
+ *
+ * Receives up to a batch of pending messages using qrtr_recv_batch(),
+ * dispatches requests to their handlers and sends the responses. Clients
+ * leaving are reported to the disconnect callback. Intended to be called
+ * when qmi_service_fd() is readable.
+ *
+ * Return: Number of messages handled, or negative errno on failure.
+ */
+int qmi_service_process(struct qmi_service *svc)
+{
+	struct qrtr_packet *pkt;
+	int count;
+	int i;
+
+	count = qrtr_recv_batch(svc->sock, svc->rx_pool, svc->rx_pkts,
+				svc->rx_sq, QMI_SERVICE_BATCH, MSG_DONTWAIT);
+	if (count < 0)
+		return count;
+
+	for (i = 0; i < count; i++) {
+		pkt = &svc->rx_pkts[i];
+
+		switch (pkt->type) {
+		case QRTR_TYPE_DATA:
+			qmi_service_handle_request(svc, &svc->rx_sq[i], pkt);
+			break;
+		case QRTR_TYPE_BYE:
+		case QRTR_TYPE_DEL_CLIENT:
+			if (svc->disconnect)
+				svc->disconnect(svc, pkt->node, pkt->port);
+			break;
+		}
+
+		qrtr_pool_put(pkt->data);
+	}
+
+	return count;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -12,6 +13,7 @@
 
 #include "logging.h"
 #include "ns.h"
+#include "probe.h"
 
 static int qrtr_getname(int sock, struct sockaddr_qrtr *sq)
 {
@@ -85,7 +87,9 @@ int qrtr_sendto(int sock, uint32_t node, uint32_t port, const void *data, unsign
 	sq.sq_node = node;
 	sq.sq_port = port;
 
+	QRTR_PROBE(qrtr_sendto_entry, node, port, sz);
 	rc = sendto(sock, data, sz, 0, (void *)&sq, sizeof(sq));
+	QRTR_PROBE(qrtr_sendto_exit, node, port, rc);
 	if (rc < 0) {
 		PLOGE("sendto()");
 		return -1;
@@ -94,6 +98,83 @@ int qrtr_sendto(int sock, uint32_t node, uint32_t port, const void *data, unsign
 	return 0;
 }
 
+int qrtr_sendmsg_iov(int sock, uint32_t node, uint32_t port,
+		     const struct iovec *iov, int iovcnt)
+{
+	struct sockaddr_qrtr sq = {};
+	struct msghdr msg = {};
+	int rc;
+
+	sq.sq_family = AF_QIPCRTR;
+	sq.sq_node = node;
+	sq.sq_port = port;
+
+	msg.msg_name = &sq;
+	msg.msg_namelen = sizeof(sq);
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+
+	rc = sendmsg(sock, &msg, 0);
+	if (rc < 0) {
+		PLOGE("sendmsg()");
+		return -1;
+	}
+
+	return 0;
+}
+
+#define QRTR_SENDMMSG_BATCH	32
+
+int qrtr_sendto_many(int sock, struct qrtr_dest *dests, unsigned int count,
+		     const void *data, unsigned int sz)
+{
+	struct sockaddr_qrtr sq[QRTR_SENDMMSG_BATCH];
+	struct mmsghdr msgs[QRTR_SENDMMSG_BATCH];
+	unsigned int batch;
+	struct iovec iov;
+	unsigned int i;
+	int sent = 0;
+	int err;
+	int rc;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = sz;
+
+	while (count) {
+		batch = count < QRTR_SENDMMSG_BATCH ? count : QRTR_SENDMMSG_BATCH;
+
+		memset(msgs, 0, batch * sizeof(msgs[0]));
+		for (i = 0; i < batch; i++) {
+			sq[i].sq_family = AF_QIPCRTR;
+			sq[i].sq_node = dests[i].node;
+			sq[i].sq_port = dests[i].port;
+
+			msgs[i].msg_hdr.msg_name = &sq[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(sq[i]);
+			msgs[i].msg_hdr.msg_iov = &iov;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		rc = sendmmsg(sock, msgs, batch, 0);
+		if (rc < 0) {
+			/* The first message of the batch failed, skip it */
+			err = errno;
+			PLOGE("sendmmsg(%u:%u)", dests[0].node, dests[0].port);
+			dests[0].err = err;
+			rc = 1;
+		} else {
+			for (i = 0; i < rc; i++)
+				dests[i].err = 0;
+			sent += rc;
+		}
+
+		dests += rc;
+		count -= rc;
+	}
+
+	return sent;
+}
+
 int qrtr_new_server(int sock, uint32_t service, uint16_t version, uint16_t instance)
 {
 	struct qrtr_ctrl_pkt pkt;
@@ -176,6 +257,190 @@ int qrtr_remove_lookup(int sock, uint32_t service, uint16_t version, uint16_t in
 	return qrtr_sendto(sock, sq.sq_node, QRTR_PORT_CTRL, &pkt, sizeof(pkt));
 }
 
+/* Replies are expected within this time */
+#define QRTR_LOOKUP_TIMEOUT_MS	1000
+
+static int qrtr_lookup_send(int sock, const struct sockaddr_qrtr *ns, int cmd,
+			    uint32_t service, uint32_t instance,
+			    uint32_t ifilter, uint32_t imin, uint32_t imax,
+			    uint32_t flags)
+{
+	struct qrtr_ctrl_lookup_ext ext;
+	size_t len = sizeof(ext.pkt);
+
+	memset(&ext, 0, sizeof(ext));
+
+	ext.pkt.cmd = cpu_to_le32(cmd);
+	ext.pkt.server.service = cpu_to_le32(service);
+	ext.pkt.server.port = cpu_to_le32(flags);
+
+	if (flags & QRTR_LOOKUP_F_RANGE) {
+		ext.instance = cpu_to_le32(instance);
+		ext.ifilter = cpu_to_le32(ifilter);
+		ext.imin = cpu_to_le32(imin);
+		ext.imax = cpu_to_le32(imax);
+		len = sizeof(ext);
+	} else {
+		ext.pkt.server.instance = cpu_to_le32(instance);
+	}
+
+	return qrtr_sendto(sock, ns->sq_node, ns->sq_port, &ext, len);
+}
+
+/**
+ * qrtr_lookup() - Look up the servers matching a service and instance
+ * @sock:	Socket to perform the lookup on
+ * @service:	Service id, 0 for any service
+ * @instance:	Instance, as version | instance << 8, 0 for any instance
+ * @ifilter:	Mask applied to the instance of servers before comparing it to
+ *		@instance, 0 for an exact match
+ * @cb:		Called with the service, instance, node and port of each
+ *		matching server
+ * @udata:	Passed to @cb
+ *
+ * Return: 0 on success, negative errno on failure.
+ */
+int qrtr_lookup(int sock, uint32_t service, uint32_t instance, uint32_t ifilter,
+		void (*cb)(void *udata, uint32_t service, uint32_t instance,
+			   uint32_t node, uint32_t port),
+		void *udata)
+{
+	return qrtr_lookup_range(sock, service, instance, ifilter, 0, ~0,
+				 cb, udata);
+}
+
+/**
+ * qrtr_lookup_range() - Look up the servers within a range of instances
+ * @sock:	Socket to perform the lookup on
+ * @service:	Service id, 0 for any service
+ * @instance:	Instance, as version | instance << 8, 0 for any instance
+ * @ifilter:	Mask applied to the instance of servers before comparing it to
+ *		@instance, 0 for an exact match
+ * @imin:	Lowest instance to report
+ * @imax:	Highest instance to report
+ * @cb:		Called with the service, instance, node and port of each
+ *		matching server
+ * @udata:	Passed to @cb
+ *
+ * The name service is asked to pack many servers into each reply and to
+ * apply @ifilter and the range itself, which is taken into account only if
+ * supported. Hence both the packed and the classic replies are handled and
+ * servers are filtered here as well. The lookup is removed again once all
+ * present servers have been reported.
+ *
+ * Return: 0 on success, negative errno on failure.
+ */
+int qrtr_lookup_range(int sock, uint32_t service, uint32_t instance,
+		      uint32_t ifilter, uint32_t imin, uint32_t imax,
+		      void (*cb)(void *udata, uint32_t service,
+				 uint32_t instance, uint32_t node,
+				 uint32_t port),
+		      void *udata)
+{
+	const struct qrtr_ctrl_packed *packed;
+	const struct qrtr_server_rec *rec;
+	const struct qrtr_ctrl_pkt *pkt;
+	struct sockaddr_qrtr ns;
+	struct sockaddr_qrtr sq;
+	uint32_t buf[QRTR_PACKED_MAX_SIZE / sizeof(uint32_t)];
+	uint32_t flags = QRTR_LOOKUP_F_PACKED;
+	uint32_t srv_instance;
+	unsigned int count;
+	unsigned int i;
+	socklen_t sl;
+	ssize_t len;
+	int rc;
+
+	if (qrtr_getname(sock, &ns))
+		return -EINVAL;
+	ns.sq_port = QRTR_PORT_CTRL;
+
+	/* Classic lookups only do exact matches */
+	if (ifilter || imin || imax != ~0u)
+		flags |= QRTR_LOOKUP_F_RANGE;
+	if (!ifilter && instance)
+		ifilter = ~0;
+
+	rc = qrtr_lookup_send(sock, &ns, QRTR_TYPE_NEW_LOOKUP, service,
+			      instance, ifilter, imin, imax, flags);
+	if (rc < 0)
+		return -EIO;
+
+	for (;;) {
+		rc = qrtr_poll(sock, QRTR_LOOKUP_TIMEOUT_MS);
+		if (rc <= 0) {
+			rc = rc ? -errno : -ETIMEDOUT;
+			break;
+		}
+
+		sl = sizeof(sq);
+		len = recvfrom(sock, buf, sizeof(buf), 0, (void *)&sq, &sl);
+		if (len < 0) {
+			rc = -errno;
+			PLOGE("recvfrom()");
+			break;
+		}
+
+		if (sq.sq_node != ns.sq_node || sq.sq_port != QRTR_PORT_CTRL ||
+		    len < sizeof(uint32_t))
+			continue;
+
+		switch (le32_to_cpu(buf[0])) {
+		case QRTR_TYPE_NEW_SERVER:
+			pkt = (void *)buf;
+			if (len < sizeof(*pkt))
+				continue;
+
+			/* All zero marks the end of the lookup */
+			if (!pkt->server.service && !pkt->server.instance &&
+			    !pkt->server.node && !pkt->server.port) {
+				rc = 0;
+				goto out;
+			}
+
+			srv_instance = le32_to_cpu(pkt->server.instance);
+			if ((srv_instance & ifilter) != instance ||
+			    srv_instance < imin || srv_instance > imax)
+				continue;
+
+			cb(udata, le32_to_cpu(pkt->server.service),
+			   srv_instance,
+			   le32_to_cpu(pkt->server.node),
+			   le32_to_cpu(pkt->server.port));
+			break;
+		case QRTR_TYPE_NEW_SERVER_PACKED:
+			packed = (void *)buf;
+			if (len < sizeof(*packed))
+				continue;
+
+			count = le32_to_cpu(packed->count);
+			if (count > (len - sizeof(*packed)) / sizeof(*rec))
+				continue;
+
+			for (i = 0; i < count; i++) {
+				rec = &packed->recs[i];
+				srv_instance = le32_to_cpu(rec->instance);
+				if ((srv_instance & ifilter) != instance ||
+				    srv_instance < imin || srv_instance > imax)
+					continue;
+
+				cb(udata, le32_to_cpu(rec->service),
+				   srv_instance,
+				   le32_to_cpu(rec->node),
+				   le32_to_cpu(rec->port));
+			}
+			break;
+		}
+	}
+
+out:
+	qrtr_lookup_send(sock, &ns, QRTR_TYPE_DEL_LOOKUP, service,
+			 instance, ifilter, imin, imax,
+			 flags & QRTR_LOOKUP_F_RANGE);
+
+	return rc;
+}
+
 int qrtr_poll(int sock, unsigned int ms)
 {
 	struct pollfd fds;
@@ -199,12 +464,14 @@ int qrtr_recv(int sock, void *buf, unsigned int bsz)
 
 int qrtr_recvfrom(int sock, void *buf, unsigned int bsz, uint32_t *node, uint32_t *port)
 {
-	struct sockaddr_qrtr sq;
+	struct sockaddr_qrtr sq = {};
 	socklen_t sl;
 	int rc;
 
+	QRTR_PROBE(qrtr_recvfrom_entry, sock, bsz);
 	sl = sizeof(sq);
 	rc = recvfrom(sock, buf, bsz, 0, (void *)&sq, &sl);
+	QRTR_PROBE(qrtr_recvfrom_exit, sq.sq_node, sq.sq_port, rc);
 	if (rc < 0) {
 		PLOGE("recvfrom()");
 		return rc;
@@ -231,6 +498,7 @@ int qrtr_decode(struct qrtr_packet *dest, void *buf, size_t len,
 			dest->node = le32_to_cpu(ctrl->client.node);
 			break;
 		case QRTR_TYPE_DEL_CLIENT:
+		case QRTR_TYPE_RESUME_TX:
 			dest->node = le32_to_cpu(ctrl->client.node);
 			dest->port = le32_to_cpu(ctrl->client.port);
 			break;
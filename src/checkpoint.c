@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+#include "logging.h"
+
+/**
+ * checkpoint_write() - Atomically replace a checkpoint file
+ * @path:	Path of the checkpoint
+ * @data:	New contents
+ * @len:	Length of @data
+ *
+ * The contents are written to a temporary file next to @path, which is
+ * then renamed over it, so readers see either the old or the new
+ * checkpoint in full.
+ *
+ * Return: 0 on success, negative errno on failure.
+ */
+int checkpoint_write(const char *path, const void *data, size_t len)
+{
+	const char *p = data;
+	char tmp[PATH_MAX];
+	ssize_t n;
+	int rc = 0;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			rc = -errno;
+			break;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	if (close(fd) < 0 && !rc)
+		rc = -errno;
+
+	if (!rc && rename(tmp, path) < 0)
+		rc = -errno;
+
+	if (rc)
+		unlink(tmp);
+
+	return rc;
+}
+
+/**
+ * checkpoint_map() - Map a checkpoint file for reading
+ * @path:	Path of the checkpoint
+ * @len:	Set to the length of the checkpoint
+ *
+ * Return: The contents of the checkpoint, to be released with
+ * checkpoint_unmap(), or NULL if there's none.
+ */
+const void *checkpoint_map(const char *path, size_t *len)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			PLOGW("open(%s)", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		PLOGW("mmap(%s)", path);
+		return NULL;
+	}
+
+	*len = st.st_size;
+
+	return data;
+}
+
+void checkpoint_unmap(const void *data, size_t len)
+{
+	munmap((void *)data, len);
+}
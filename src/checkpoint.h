@@ -0,0 +1,10 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stddef.h>
+
+int checkpoint_write(const char *path, const void *data, size_t len);
+const void *checkpoint_map(const char *path, size_t *len);
+void checkpoint_unmap(const void *data, size_t len);
+
+#endif
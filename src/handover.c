@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handover.h"
+
+#include "logging.h"
+
+static socklen_t handover_addr(struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+
+	/* Abstract, so a stale socket never blocks a restart */
+	memcpy(sun->sun_path + 1, HANDOVER_SOCKET_NAME,
+	       strlen(HANDOVER_SOCKET_NAME));
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 +
+	       strlen(HANDOVER_SOCKET_NAME);
+}
+
+/**
+ * handover_listen() - Accept handover requests from a new name service
+ *
+ * Return: The listening socket, or -1 with errno set on failure.
+ */
+int handover_listen(void)
+{
+	struct sockaddr_un sun;
+	socklen_t sl;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	sl = handover_addr(&sun);
+	if (bind(sock, (void *)&sun, sl) < 0 || listen(sock, 1) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/**
+ * handover_accept() - Accept a handover request
+ * @lsock:	Socket returned by handover_listen()
+ *
+ * The control socket is only handed to processes of the same user, or of
+ * root.
+ *
+ * Return: The connection to the new name service, or -1 on failure.
+ */
+int handover_accept(int lsock)
+{
+	struct ucred cred;
+	socklen_t sl = sizeof(cred);
+	int fd;
+
+	fd = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		PLOGW("handover accept");
+		return -1;
+	}
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &sl) < 0) {
+		PLOGW("handover peer credentials");
+		close(fd);
+		return -1;
+	}
+
+	if (cred.uid != 0 && cred.uid != geteuid()) {
+		LOGW("refusing handover to pid %d of uid %u",
+		     cred.pid, cred.uid);
+		close(fd);
+		return -1;
+	}
+
+	LOGD("handing over to pid %d\n", cred.pid);
+
+	return fd;
+}
+
+/**
+ * handover_connect() - Request a handover from the running name service
+ *
+ * Return: The connection to the running name service, or -1 with errno set
+ * when there's none.
+ */
+int handover_connect(void)
+{
+	struct sockaddr_un sun;
+	socklen_t sl;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	sl = handover_addr(&sun);
+	if (connect(fd, (void *)&sun, sl) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int handover_write(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int handover_read(int fd, char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * handover_send() - Pass the control socket and the state along
+ * @fd:		Connection to the new name service
+ * @sock:	Control socket
+ * @hb:		Serialized state
+ *
+ * Return: 0 on success, -1 with errno set on failure.
+ */
+int handover_send(int fd, int sock, const struct handover_buf *hb)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	uint64_t len = hb->len;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	memset(&msg, 0, sizeof(msg));
+
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(len))
+		return -1;
+
+	return handover_write(fd, hb->data, hb->len);
+}
+
+/**
+ * handover_recv() - Receive the control socket and the state
+ * @fd:		Connection to the old name service
+ * @sock:	Set to the control socket
+ * @hb:		Filled with the serialized state, to be freed by the caller
+ *
+ * Return: 0 on success, -1 with errno set on failure.
+ */
+int handover_recv(int fd, int *sock, struct handover_buf *hb)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	uint64_t len;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(hb, 0, sizeof(*hb));
+
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (n != sizeof(len) || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	memcpy(sock, CMSG_DATA(cmsg), sizeof(int));
+
+	hb->data = malloc(len ? len : 1);
+	if (!hb->data)
+		goto err;
+	hb->size = hb->len = len;
+
+	if (handover_read(fd, hb->data, len) < 0)
+		goto err;
+
+	return 0;
+
+err:
+	handover_buf_free(hb);
+	close(*sock);
+	return -1;
+}
+
+/* Tells the old name service the new one is serving */
+int handover_ack(int fd)
+{
+	char ack = 0;
+
+	return handover_write(fd, &ack, sizeof(ack));
+}
+
+int handover_wait_ack(int fd, unsigned int ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char ack;
+	int rc;
+
+	rc = poll(&pfd, 1, ms);
+	if (rc <= 0) {
+		if (!rc)
+			errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return handover_read(fd, &ack, sizeof(ack));
+}
+
+int handover_put(struct handover_buf *hb, const void *data, size_t len)
+{
+	size_t size;
+	char *p;
+
+	if (hb->len + len > hb->size) {
+		size = hb->size ? hb->size : 4096;
+		while (size < hb->len + len)
+			size *= 2;
+
+		p = realloc(hb->data, size);
+		if (!p)
+			return -ENOMEM;
+
+		hb->data = p;
+		hb->size = size;
+	}
+
+	memcpy(hb->data + hb->len, data, len);
+	hb->len += len;
+
+	return 0;
+}
+
+int handover_get(struct handover_buf *hb, void *data, size_t len)
+{
+	if (hb->len - hb->off < len)
+		return -EPROTO;
+
+	memcpy(data, hb->data + hb->off, len);
+	hb->off += len;
+
+	return 0;
+}
+
+void handover_buf_free(struct handover_buf *hb)
+{
+	free(hb->data);
+	memset(hb, 0, sizeof(*hb));
+}
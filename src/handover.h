@@ -0,0 +1,35 @@
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Abstract unix socket the running name service accepts handovers on */
+#define HANDOVER_SOCKET_NAME	"qrtr-ns-handover"
+
+/* Time the old process waits for the new one to take over */
+#define HANDOVER_TIMEOUT_MS	5000
+
+struct handover_buf {
+	char *data;
+	size_t len;
+	size_t size;
+
+	/* Read position */
+	size_t off;
+};
+
+int handover_listen(void);
+int handover_accept(int lsock);
+int handover_connect(void);
+
+int handover_send(int fd, int sock, const struct handover_buf *hb);
+int handover_recv(int fd, int *sock, struct handover_buf *hb);
+int handover_ack(int fd);
+int handover_wait_ack(int fd, unsigned int ms);
+
+int handover_put(struct handover_buf *hb, const void *data, size_t len);
+int handover_get(struct handover_buf *hb, void *data, size_t len);
+void handover_buf_free(struct handover_buf *hb);
+
+#endif
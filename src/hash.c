@@ -1,6 +1,27 @@
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
 #include "hash.h"
 
+/* Per-process secret, so remote peers can't predict which keys collide */
+static uint64_t hash_seed[2];
+
+static void __attribute__((constructor)) hash_seed_init(void)
+{
+	struct timespec ts;
+
+	if (getrandom(hash_seed, sizeof(hash_seed), GRND_NONBLOCK) ==
+	    sizeof(hash_seed))
+		return;
+
+	/* Better than nothing, when the entropy pool isn't ready yet */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	hash_seed[0] = ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32);
+	hash_seed[1] = (uint64_t)getpid() * 0x9e3779b97f4a7c15ULL ^
+		       (uintptr_t)&ts;
+}
+
 unsigned int hash_mem(const void *data, unsigned int len)
 {
 	unsigned int h;
@@ -19,14 +40,37 @@ unsigned int hash_string(const char *value)
 	return hash_mem(value, strlen(value));
 }
 
+/*
+ * Keys of maps are compared by their hash only, so this has to remain a
+ * bijection: the seed is mixed in by xor and by multiplications with odd
+ * numbers, and every other step is an invertible xor-shift.
+ */
 unsigned int hash_u32(uint32_t value)
 {
-	return value * 2654435761UL;
+	uint32_t h = value ^ (uint32_t)hash_seed[0];
+
+	h *= (uint32_t)(hash_seed[0] >> 32) | 1;
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	h *= (uint32_t)(hash_seed[1] >> 32) | 1;
+	h ^= h >> 16;
+
+	return h ^ (uint32_t)hash_seed[1];
 }
 
 unsigned int hash_u64(uint64_t value)
 {
-	return hash_u32(value & 0xffffffff) ^ hash_u32(value >> 32);
+	uint64_t h = value ^ hash_seed[0];
+
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	h ^= hash_seed[1];
+
+	return h ^ (h >> 32);
 }
 
 unsigned int hash_pointer(void *value)
@@ -0,0 +1,144 @@
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "map.h"
+
+#define BENCH_GETS	100
+
+struct bench_item {
+	struct map_item mi;
+};
+
+/* hash_u32() before it was seeded, for comparison */
+static unsigned int hash_u32_fixed(uint32_t value)
+{
+	return value * 2654435761UL;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_run(const char *name, unsigned int (*hash)(uint32_t),
+		      const uint32_t *keys, unsigned int count)
+{
+	struct bench_item *items;
+	unsigned long total = 0;
+	unsigned int max = 0;
+	unsigned int probes;
+	struct map map;
+	uint64_t start;
+	unsigned int i;
+	unsigned int r;
+
+	items = calloc(count, sizeof(*items));
+	if (!items) {
+		fprintf(stderr, "failed to allocate items\n");
+		exit(1);
+	}
+
+	map_create(&map);
+	for (i = 0; i < count; i++)
+		map_put(&map, hash(keys[i]), &items[i].mi);
+
+	for (i = 0; i < count; i++) {
+		probes = map_probes(&map, hash(keys[i]));
+		total += probes;
+		if (probes > max)
+			max = probes;
+	}
+
+	start = bench_now();
+	for (r = 0; r < BENCH_GETS; r++) {
+		for (i = 0; i < count; i++)
+			map_get(&map, hash(keys[i]));
+	}
+
+	printf("%-12s %-12s %6u keys %7.1f avg %6u max probes %8.1f ns/get\n",
+	       hash == hash_u32 ? "seeded" : "fixed", name, count,
+	       (double)total / count, max,
+	       (double)(bench_now() - start) / (BENCH_GETS * count));
+
+	map_destroy(&map);
+	free(items);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "%s [-n <keys>]\n", progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int (*hashes[])(uint32_t) = { hash_u32_fixed, hash_u32 };
+	unsigned int count = 1000;
+	uint32_t *sequential;
+	uint32_t *adversarial;
+	uint32_t *random;
+	char *progname;
+	uint32_t inv;
+	unsigned int i;
+	int opt;
+
+	progname = basename(argv[0]);
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+
+	if (!count)
+		usage(progname);
+
+	sequential = calloc(count, sizeof(uint32_t));
+	adversarial = calloc(count, sizeof(uint32_t));
+	random = calloc(count, sizeof(uint32_t));
+	if (!sequential || !adversarial || !random) {
+		fprintf(stderr, "failed to allocate keys\n");
+		return 1;
+	}
+
+	/* Inverse of the fixed multiplier, by Newton's iteration mod 2^32 */
+	inv = 2654435761U;
+	for (i = 0; i < 5; i++)
+		inv *= 2 - 2654435761U * inv;
+
+	/*
+	 * The fixed hash of each adversarial key is a multiple of 65536, so
+	 * they share one home slot in any map size dividing it
+	 */
+	srand(time(NULL));
+	for (i = 0; i < count; i++) {
+		sequential[i] = i + 1;
+		adversarial[i] = (i + 1) * 65536U * inv;
+		random[i] = rand();
+	}
+
+	for (i = 0; i < sizeof(hashes) / sizeof(hashes[0]); i++) {
+		bench_run("sequential", hashes[i], sequential, count);
+		bench_run("adversarial", hashes[i], adversarial, count);
+		bench_run("random", hashes[i], random, count);
+	}
+
+	free(sequential);
+	free(adversarial);
+	free(random);
+
+	return 0;
+}
@@ -129,7 +129,7 @@ static int get_diag_instance_info(char *str, size_t size, unsigned int instance)
 			diag_instance_str(instance & 0x3f));
 }
 
-static unsigned int read_num_le(const char *str, int *rcp)
+static unsigned int read_num(const char *str, int *rcp)
 {
 	unsigned int ret;
 	char *e;
@@ -141,36 +141,62 @@ static unsigned int read_num_le(const char *str, int *rcp)
 	ret = strtoul(str, &e, 0);
 	*rcp = -(errno || *e);
 
-	return cpu_to_le32(ret);
+	return ret;
+}
+
+static void print_server(void *udata, uint32_t service, uint32_t raw_instance,
+			 uint32_t node, uint32_t port)
+{
+	unsigned int version = raw_instance & 0xff;
+	unsigned int instance = raw_instance >> 8;
+	const char *name = NULL;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(common_names)/sizeof(common_names[0]); ++i) {
+		if (service != common_names[i].service)
+			continue;
+		if (instance &&
+		   (instance & common_names[i].ifilter) != common_names[i].ifilter)
+			continue;
+		name = common_names[i].name;
+	}
+	if (!name)
+		name = "<unknown>";
+
+	if (service == DIAG_SERVICE) {
+		char buf[24];
+		get_diag_instance_info(buf, sizeof(buf), raw_instance);
+		printf("%9u %s %8u %4u %5u %s (%s)\n",
+			service, "N/A", raw_instance, node, port, name, buf);
+	} else {
+		printf("%9u %7u %8u %4u %5u %s\n",
+			service, version, instance, node, port, name);
+	}
 }
 
 int main(int argc, char **argv)
 {
-	struct qrtr_ctrl_pkt pkt;
-	struct sockaddr_qrtr sq;
-	unsigned int instance;
-	unsigned int service;
-	unsigned int version;
-	unsigned int node;
-	unsigned int port;
-	socklen_t sl = sizeof(sq);
-	struct timeval tv;
+	unsigned int instance = 0;
+	unsigned int service = 0;
+	unsigned int ifilter = 0;
 	int sock;
-	int len;
 	int rc;
 	const char *progname = basename(argv[0]);
 
 	qlog_setup(progname, false);
 
 	rc = 0;
-	memset(&pkt, 0, sizeof(pkt));
 
 	switch (argc) {
 	default:
 		rc = -1;
 		break;
-	case 3: pkt.server.instance = read_num_le(argv[2], &rc);
-	case 2: pkt.server.service = read_num_le(argv[1], &rc);
+	case 4: ifilter = read_num(argv[3], &rc);
+		/* fall through */
+	case 3: instance = read_num(argv[2], &rc);
+		/* fall through */
+	case 2: service = read_num(argv[1], &rc);
+		/* fall through */
 	case 1: break;
 	}
 	if (rc) {
@@ -178,78 +204,17 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+	sock = qrtr_open(0);
 	if (sock < 0)
-		PLOGE_AND_EXIT("sock(AF_QIPCRTR)");
-
-	rc = getsockname(sock, (void *)&sq, &sl);
-	if (rc || sq.sq_family != AF_QIPCRTR || sl != sizeof(sq))
-		PLOGE_AND_EXIT("getsockname()");
-
-	sq.sq_port = QRTR_PORT_CTRL;
-
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-
-	pkt.cmd = cpu_to_le32(QRTR_TYPE_NEW_LOOKUP);
-
-	rc = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-	if (rc)
-		PLOGE_AND_EXIT("setsockopt(SO_RCVTIMEO)");
-
-	rc = sendto(sock, &pkt, sizeof(pkt), 0, (void *)&sq, sizeof(sq));
-	if (rc < 0)
-		PLOGE_AND_EXIT("sendto()");
+		LOGE_AND_EXIT("unable to open qrtr socket");
 
 	printf("  Service Version Instance Node  Port\n");
 
-	while ((len = recv(sock, &pkt, sizeof(pkt), 0)) > 0) {
-		unsigned int type = le32_to_cpu(pkt.cmd);
-		const char *name = NULL;
-		unsigned int i;
-
-		if (len < sizeof(pkt) || type != QRTR_TYPE_NEW_SERVER) {
-			PLOGW("invalid/short packet");
-			continue;
-		}
-
-		if (!pkt.server.service && !pkt.server.instance &&
-		    !pkt.server.node && !pkt.server.port)
-			break;
-
-		service = le32_to_cpu(pkt.server.service);
-		version = le32_to_cpu(pkt.server.instance) & 0xff;
-		instance = le32_to_cpu(pkt.server.instance) >> 8;
-		node = le32_to_cpu(pkt.server.node);
-		port = le32_to_cpu(pkt.server.port);
-
-		for (i = 0; i < sizeof(common_names)/sizeof(common_names[0]); ++i) {
-			if (service != common_names[i].service)
-				continue;
-			if (instance &&
-			   (instance & common_names[i].ifilter) != common_names[i].ifilter)
-				continue;
-			name = common_names[i].name;
-		}
-		if (!name)
-			name = "<unknown>";
-
-		if (service == DIAG_SERVICE) {
-			char buf[24];
-			instance = le32_to_cpu(pkt.server.instance);
-			get_diag_instance_info(buf, sizeof(buf), instance);
-			printf("%9u %s %8u %4u %5u %s (%s)\n",
-				service, "N/A", instance, node, port, name, buf);
-		} else {
-			printf("%9u %7u %8u %4u %5u %s\n",
-				service, version, instance, node, port, name);
-		}
-	}
-
-	if (len < 0)
-		PLOGE_AND_EXIT("recv()");
+	rc = qrtr_lookup(sock, service, instance, ifilter, print_server, NULL);
+	if (rc < 0)
+		LOGE_AND_EXIT("lookup failed: %s", strerror(-rc));
 
-	close(sock);
+	qrtr_close(sock);
 
 	return 0;
 }
@@ -66,7 +66,8 @@ static int map_hash(struct map *map, unsigned int key)
 	struct map_entry *e;
 	int idx, i;
 
-	if (map->count == map->size)
+	/* Keep probe sequences short by growing at 3/4 occupancy */
+	if (map->count >= map->size - map->size / 4)
 		return -1;
 
 	idx = key % map->size;
@@ -170,6 +171,30 @@ static struct map_entry *map_find(const struct map *map, unsigned int key)
 	return NULL;
 }
 
+/* Slots visited by a lookup of @key, for measuring clustering */
+unsigned int map_probes(const struct map *map, unsigned int key)
+{
+	struct map_entry *e;
+	int idx, i;
+
+	if (map->size == 0)
+		return 0;
+
+	idx = key % map->size;
+
+	for (i = 0; i < map->size;) {
+		e = &map->data[idx];
+		idx = (idx + 1) % map->size;
+		++i;
+
+		if (!e->item)
+			break;
+		if (e->item != &deleted && e->item->key == key)
+			break;
+	}
+	return i;
+}
+
 int map_contains(const struct map *map, unsigned int key)
 {
 	return (map_find(map, key) == NULL) ? 0 : 1;
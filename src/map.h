@@ -24,6 +24,7 @@ int map_contains(const struct map *map, unsigned int key);
 struct map_item *map_get(const struct map *map, unsigned int key);
 int map_remove(struct map *map, unsigned int key);
 unsigned int map_length(struct map *map);
+unsigned int map_probes(const struct map *map, unsigned int key);
 
 struct map_entry *map_iter_first(const struct map *map);
 struct map_entry *map_iter_next(const struct map *map, struct map_entry *iter);
@@ -1,706 +1,733 @@
 #include <err.h>
 #include <errno.h>
 #include <libqrtr.h>
+#include <libqrtr-ns.h>
 #include <libgen.h>
 #include <limits.h>
 #include <linux/qrtr.h>
-#include <linux/netlink.h>
-#include <linux/rtnetlink.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "addr.h"
+#include "checkpoint.h"
+#include "handover.h"
 #include "hash.h"
-#include "list.h"
-#include "map.h"
-#include "ns.h"
+#include "probe.h"
+#include "rxq.h"
+#include "sender.h"
+#include "txq.h"
+#include "uring.h"
 #include "util.h"
 #include "waiter.h"
 
 #include "logging.h"
 
-static const char *ctrl_pkt_strings[] = {
-	[QRTR_TYPE_HELLO]	= "hello",
-	[QRTR_TYPE_BYE]		= "bye",
-	[QRTR_TYPE_NEW_SERVER]	= "new-server",
-	[QRTR_TYPE_DEL_SERVER]	= "del-server",
-	[QRTR_TYPE_DEL_CLIENT]	= "del-client",
-	[QRTR_TYPE_RESUME_TX]	= "resume-tx",
-	[QRTR_TYPE_EXIT]	= "exit",
-	[QRTR_TYPE_PING]	= "ping",
-	[QRTR_TYPE_NEW_LOOKUP]	= "new-lookup",
-	[QRTR_TYPE_DEL_LOOKUP]	= "del-lookup",
-};
+/* Registry checkpoints are written this often, if anything changed */
+#define CHECKPOINT_INTERVAL_MS	5000
 
-#define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
+/* Time remote nodes get to confirm servers restored from a checkpoint */
+#define CHECKPOINT_GRACE_MS	10000
 
 struct context {
+	struct qrtr_ns *ns;
+
 	int sock;
+	struct waiter_ticket *ctrl_tkt;
 
 	int local_node;
 
-	struct sockaddr_qrtr bcast_sq;
+	/* NULL when using plain socket calls */
+	struct ns_uring *uring;
 
-	struct list lookups;
-};
+	/* Packets received, waiting to be handled by priority */
+	struct rxq rxq;
 
-struct server_filter {
-	unsigned int service;
-	unsigned int instance;
-	unsigned int ifilter;
-};
+	struct txq txq;
+	struct waiter_ticket *txq_tkt;
+	bool txq_armed;
 
-struct lookup {
-	unsigned int service;
-	unsigned int instance;
+	/* When set all sends are handed to the sender thread */
+	struct sender *sender;
+	bool use_sender;
 
-	struct sockaddr_qrtr sq;
-	struct list_item li;
-};
+	/* Unbound, for probing local ports, -1 outside of restoring */
+	int probe_sock;
 
-struct server {
-	unsigned int service;
-	unsigned int instance;
+	/* Listening for a new instance to take over */
+	int handover_sock;
+	struct waiter_ticket *handover_tkt;
 
-	unsigned int node;
-	unsigned int port;
-	struct map_item mi;
-	struct list_item qli;
+	/* NULL when not checkpointing */
+	const char *ckpt_path;
+
+	/* NULL when SIGUSR1 doesn't dump the trace ring */
+	const char *trace_path;
+	int trace_fd;
 };
 
-struct node {
-	unsigned int id;
+static int ns_sendto(void *data, const struct sockaddr_qrtr *to,
+		     const void *buf, size_t len)
+{
+	struct context *ctx = data;
 
-	struct map_item mi;
-	struct map services;
-};
+	if (ctx->sender)
+		return sender_sendto(ctx->sender, to, buf, len);
+	if (ctx->uring)
+		return ns_uring_sendto(ctx->uring, to, buf, len);
 
-static struct map nodes;
+	return txq_sendto(&ctx->txq, to, buf, len);
+}
 
-static void server_mi_free(struct map_item *mi);
+static void ns_resume(void *data, unsigned int node, unsigned int port)
+{
+	struct context *ctx = data;
 
-static struct node *node_get(unsigned int node_id)
+	if (ctx->sender)
+		sender_resume(ctx->sender, node, port);
+	else
+		txq_resume(&ctx->txq, node, port);
+}
+
+static void ns_drop(void *data, unsigned int node, unsigned int port)
 {
-	struct map_item *mi;
-	struct node *node;
-	int rc;
+	struct context *ctx = data;
 
-	mi = map_get(&nodes, hash_u32(node_id));
-	if (mi)
-		return container_of(mi, struct node, mi);
+	if (ctx->sender)
+		sender_drop(ctx->sender, node, port);
+	else
+		txq_drop(&ctx->txq, node, port);
+}
 
-	node = calloc(1, sizeof(*node));
-	if (!node)
-		return NULL;
+/*
+ * An empty data message is ignored by clients, but fails right away when
+ * nobody has the port open anymore. It can't come from the control socket,
+ * the control port only sends control messages, so a socket of its own is
+ * used. Sent directly, as the result is needed now.
+ */
+static int ns_probe(void *data, unsigned int node, unsigned int port)
+{
+	struct context *ctx = data;
+	struct sockaddr_qrtr sq = {};
 
-	node->id = node_id;
+	if (ctx->probe_sock < 0)
+		return -ENOTCONN;
 
-	rc = map_create(&node->services);
-	if (rc)
-		LOGE_AND_EXIT("unable to create map");
+	sq.sq_family = AF_QIPCRTR;
+	sq.sq_node = node;
+	sq.sq_port = port;
 
-	rc = map_put(&nodes, hash_u32(node_id), &node->mi);
-	if (rc) {
-		map_destroy(&node->services);
-		free(node);
-		return NULL;
-	}
+	if (sendto(ctx->probe_sock, NULL, 0, MSG_DONTWAIT, (void *)&sq,
+		   sizeof(sq)) < 0)
+		return -errno;
 
-	return node;
+	return 0;
 }
 
-static int server_match(const struct server *srv, const struct server_filter *f)
+static const struct qrtr_ns_ops ns_ops = {
+	.send = ns_sendto,
+	.resume = ns_resume,
+	.drop = ns_drop,
+	.probe = ns_probe,
+};
+
+/* Retry parked destinations periodically, only while there are any */
+static void txq_arm(struct context *ctx)
 {
-	unsigned int ifilter = f->ifilter;
+	bool pending = txq_pending(&ctx->txq);
 
-	if (f->service != 0 && srv->service != f->service)
-		return 0;
-	if (!ifilter && f->instance)
-		ifilter = ~0;
-	return (srv->instance & ifilter) == f->instance;
+	if (!ctx->txq_tkt || pending == ctx->txq_armed)
+		return;
+
+	if (pending)
+		waiter_ticket_set_timeout(ctx->txq_tkt, TXQ_RETRY_MS);
+	else
+		waiter_ticket_set_null(ctx->txq_tkt);
+	ctx->txq_armed = pending;
 }
 
-static int server_query(const struct server_filter *f, struct list *list)
+static void txq_fn(void *vcontext, struct waiter_ticket *tkt)
 {
-	struct map_entry *node_me;
-	struct map_entry *me;
-	struct node *node;
-	int count = 0;
-
-	list_init(list);
-	map_for_each(&nodes, node_me) {
-		node = map_iter_data(node_me, struct node, mi);
-
-		map_for_each(&node->services, me) {
-			struct server *srv;
+	struct context *ctx = vcontext;
 
-			srv = map_iter_data(me, struct server, mi);
-			if (!server_match(srv, f))
-				continue;
+	txq_flush(&ctx->txq);
+	txq_arm(ctx);
 
-			list_append(list, &srv->qli);
-			++count;
-		}
-	}
-
-	return count;
+	waiter_ticket_clear(tkt);
 }
 
-static int service_announce_new(struct context *ctx,
-				struct sockaddr_qrtr *dest,
-				struct server *srv)
+static void ctrl_process(void *vcontext, struct sockaddr_qrtr *sq,
+			 const void *buf, size_t len)
 {
-	struct qrtr_ctrl_pkt cmsg;
+	struct context *ctx = vcontext;
 	int rc;
 
-	LOGD("advertising new server [%u:%x]@[%u:%u]\n",
-		srv->service, srv->instance, srv->node, srv->port);
+	QRTR_PROBE(ns_dispatch_entry, sq->sq_node, sq->sq_port, len);
+	rc = qrtr_ns_process_packet(ctx->ns, sq, buf, len);
+	QRTR_PROBE(ns_dispatch_exit, sq->sq_node, sq->sq_port, rc);
 
-	cmsg.cmd = cpu_to_le32(QRTR_TYPE_NEW_SERVER);
-	cmsg.server.service = cpu_to_le32(srv->service);
-	cmsg.server.instance = cpu_to_le32(srv->instance);
-	cmsg.server.node = cpu_to_le32(srv->node);
-	cmsg.server.port = cpu_to_le32(srv->port);
-
-	rc = sendto(ctx->sock, &cmsg, sizeof(cmsg), 0,
-		    (struct sockaddr *)dest, sizeof(*dest));
-	if (rc < 0)
-		PLOGW("sendto()");
-
-	return rc;
+	txq_arm(ctx);
 }
 
-static int service_announce_del(struct context *ctx,
-				struct sockaddr_qrtr *dest,
-				struct server *srv)
+static void ctrl_port_fn(void *vcontext, struct waiter_ticket *tkt)
 {
-	struct qrtr_ctrl_pkt cmsg;
-	int rc;
+	struct context *ctx = vcontext;
+	struct rxq_msg *msg;
+	int sock = ctx->sock;
+	socklen_t sl;
+	ssize_t len;
 
-	LOGD("advertising removal of server [%u:%x]@[%u:%u]\n",
-		srv->service, srv->instance, srv->node, srv->port);
+	/* Take a batch of what's pending, to handle it by priority */
+	while ((msg = rxq_next(&ctx->rxq)) != NULL) {
+		sl = sizeof(msg->sq);
+		len = recvfrom(sock, msg->buf, sizeof(msg->buf), MSG_DONTWAIT,
+			       (void *)&msg->sq, &sl);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
 
-	cmsg.cmd = cpu_to_le32(QRTR_TYPE_DEL_SERVER);
-	cmsg.server.service = cpu_to_le32(srv->service);
-	cmsg.server.instance = cpu_to_le32(srv->instance);
-	cmsg.server.node = cpu_to_le32(srv->node);
-	cmsg.server.port = cpu_to_le32(srv->port);
+		if (len <= 0) {
+			PLOGW("recvfrom()");
+			rxq_drain(&ctx->rxq, ctrl_process, ctx);
+			close(sock);
+			ctx->sock = -1;
+			goto out;
+		}
 
-	rc = sendto(ctx->sock, &cmsg, sizeof(cmsg), 0,
-		    (struct sockaddr *)dest, sizeof(*dest));
-	if (rc < 0)
-		PLOGW("sendto()");
+		QRTR_PROBE(ns_rx, msg->sq.sq_node, msg->sq.sq_port, len);
+		rxq_commit(&ctx->rxq, len);
+	}
 
-	return rc;
+	rxq_drain(&ctx->rxq, ctrl_process, ctx);
+out:
+	waiter_ticket_clear(tkt);
 }
 
-static int lookup_notify(struct context *ctx, struct sockaddr_qrtr *to,
-			 struct server *srv, bool new)
+/* Completions are batched too, uring_fn() drains what's left */
+static void uring_rx_fn(void *vcontext, struct sockaddr_qrtr *sq,
+			const void *buf, size_t len)
 {
-	struct qrtr_ctrl_pkt pkt = {};
-	int rc;
+	struct context *ctx = vcontext;
 
-	pkt.cmd = new ? QRTR_TYPE_NEW_SERVER : QRTR_TYPE_DEL_SERVER;
-	if (srv) {
-		pkt.server.service = cpu_to_le32(srv->service);
-		pkt.server.instance = cpu_to_le32(srv->instance);
-		pkt.server.node = cpu_to_le32(srv->node);
-		pkt.server.port = cpu_to_le32(srv->port);
+	QRTR_PROBE(ns_rx, sq->sq_node, sq->sq_port, len);
+	if (rxq_push(&ctx->rxq, sq, buf, len) < 0) {
+		rxq_drain(&ctx->rxq, ctrl_process, ctx);
+		rxq_push(&ctx->rxq, sq, buf, len);
 	}
-
-	rc = sendto(ctx->sock, &pkt, sizeof(pkt), 0,
-		    (struct sockaddr *)to, sizeof(*to));
-	if (rc < 0)
-		PLOGW("send lookup result failed");
-	return rc;
 }
 
-static int annouce_servers(struct context *ctx, struct sockaddr_qrtr *sq)
+static void uring_fn(void *vcontext, struct waiter_ticket *tkt)
 {
-	struct map_entry *me;
-	struct server *srv;
-	struct node *node;
+	struct context *ctx = vcontext;
 	int rc;
 
-	node = node_get(ctx->local_node);
-	if (!node)
-		return 0;
+	rc = ns_uring_process(ctx->uring);
+	rxq_drain(&ctx->rxq, ctrl_process, ctx);
+	if (rc == -EOPNOTSUPP) {
+		LOGW("io_uring lacks multishot receive, using plain sockets");
+		ns_uring_destroy(ctx->uring);
+		ctx->uring = NULL;
+
+		waiter_ticket_set_fd(tkt, ctx->sock);
+		waiter_ticket_callback(tkt, ctrl_port_fn, ctx);
+	} else if (rc < 0) {
+		LOGW("io_uring receive failed: %s", strerror(-rc));
+		ns_uring_destroy(ctx->uring);
+		ctx->uring = NULL;
+		close(ctx->sock);
+		ctx->sock = -1;
+	}
 
-	map_for_each(&node->services, me) {
-		srv = map_iter_data(me, struct server, mi);
+	waiter_ticket_clear(tkt);
+}
 
-		rc = service_announce_new(ctx, sq, srv);
-		if (rc < 0)
-			return rc;
+static int ns_io_start(struct context *ctx)
+{
+	if (ctx->use_sender) {
+		ctx->sender = sender_create(ctx->sock);
+		if (!ctx->sender)
+			return -1;
+	}
+
+	ctx->uring = ns_uring_create(ctx->sock, uring_rx_fn, ctx);
+	if (ctx->uring) {
+		waiter_ticket_set_fd(ctx->ctrl_tkt, ns_uring_fd(ctx->uring));
+		waiter_ticket_callback(ctx->ctrl_tkt, uring_fn, ctx);
+	} else {
+		waiter_ticket_set_fd(ctx->ctrl_tkt, ctx->sock);
+		waiter_ticket_callback(ctx->ctrl_tkt, ctrl_port_fn, ctx);
 	}
 
 	return 0;
 }
 
-static struct server *server_add(unsigned int service, unsigned int instance,
-	unsigned int node_id, unsigned int port)
+/* Stops reading the control socket, after sending everything queued */
+static void ns_io_stop(struct context *ctx)
 {
-	struct map_item *mi;
-	struct server *srv;
-	struct node *node;
-	int rc;
-
-	if (!service || !port)
-		return NULL;
+	if (ctx->uring) {
+		ns_uring_destroy(ctx->uring);
+		ctx->uring = NULL;
+	}
 
-	srv = calloc(1, sizeof(*srv));
-	if (srv == NULL)
-		return NULL;
+	/* Handle the last completions before the state is handed over */
+	rxq_drain(&ctx->rxq, ctrl_process, ctx);
 
-	srv->service = service;
-	srv->instance = instance;
-	srv->node = node_id;
-	srv->port = port;
+	if (ctx->sender) {
+		sender_destroy(ctx->sender, &ctx->txq);
+		ctx->sender = NULL;
+	}
 
-	node = node_get(node_id);
-	if (!node)
-		goto err;
+	waiter_ticket_set_null(ctx->ctrl_tkt);
+	txq_arm(ctx);
+}
 
-	rc = map_reput(&node->services, hash_u32(port), &srv->mi, &mi);
-	if (rc)
-		goto err;
+#define NS_HANDOVER_MAGIC	0x716e7368
+#define NS_HANDOVER_VERSION	2
 
-	LOGD("add server [%u:%x]@[%u:%u]\n", srv->service, srv->instance,
-		srv->node, srv->port);
+/* Followed by the name service state, then the queued messages */
+struct ns_handover_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t state_len;
+	uint32_t msgs;
+};
 
-	if (mi) { /* we replaced someone */
-		struct server *old = container_of(mi, struct server, mi);
-		free(old);
-	}
+struct ns_handover_msg {
+	uint32_t node;
+	uint32_t port;
+	uint32_t len;
+};
 
-	return srv;
+struct ns_handover_state {
+	struct handover_buf *hb;
+	uint32_t msgs;
+	int rc;
+};
 
-err:
-	free(srv);
-	return NULL;
+static void ns_handover_put_msg(void *data, const struct sockaddr_qrtr *sq,
+				const void *buf, size_t len)
+{
+	struct ns_handover_state *state = data;
+	struct ns_handover_msg msg;
+
+	msg.node = sq->sq_node;
+	msg.port = sq->sq_port;
+	msg.len = len;
+
+	if (!state->rc)
+		state->rc = handover_put(state->hb, &msg, sizeof(msg));
+	if (!state->rc)
+		state->rc = handover_put(state->hb, buf, len);
+	state->msgs++;
 }
 
-static int server_del(struct context *ctx, struct node *node, unsigned int port)
+/*
+ * The registry, the lookups and the messages still waiting for their
+ * destination to resume, everything the new instance needs to carry on
+ * without any peer noticing.
+ */
+static int ns_handover_save(struct context *ctx, struct handover_buf *hb)
 {
-	struct lookup *lookup;
-	struct list_item *li;
-	struct map_item *mi;
-	struct server *srv;
-
-	mi = map_get(&node->services, hash_u32(port));
-	if (!mi)
-		return -ENOENT;
-
-	srv = container_of(mi, struct server, mi);
-	map_remove(&node->services, srv->mi.key);
-
-	/* Broadcast the removal of local services */
-	if (srv->node == ctx->local_node)
-		service_announce_del(ctx, &ctx->bcast_sq, srv);
-
-	/* Announce the service's disappearance to observers */
-	list_for_each(&ctx->lookups, li) {
-		lookup = container_of(li, struct lookup, li);
-		if (lookup->service && lookup->service != srv->service)
-			continue;
-		if (lookup->instance && lookup->instance != srv->instance)
-			continue;
-
-		lookup_notify(ctx, &lookup->sq, srv, false);
-	}
+	struct ns_handover_state state = { .hb = hb };
+	struct ns_handover_hdr hdr;
+	void *data;
+	size_t len;
+	int rc;
 
-	free(srv);
+	rc = qrtr_ns_state_save(ctx->ns, &data, &len);
+	if (rc)
+		return rc;
 
-	return 0;
-}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NS_HANDOVER_MAGIC;
+	hdr.version = NS_HANDOVER_VERSION;
+	hdr.state_len = len;
 
-static int ctrl_cmd_hello(struct context *ctx, struct sockaddr_qrtr *sq,
-			  const void *buf, size_t len)
-{
-	int rc;
+	/* Message count filled in at the end */
+	rc = handover_put(hb, &hdr, sizeof(hdr));
+	if (!rc)
+		rc = handover_put(hb, data, len);
+	free(data);
+	if (rc)
+		return rc;
 
-	rc = sendto(ctx->sock, buf, len, 0, (void *)sq, sizeof(*sq));
-	if (rc > 0)
-		rc = annouce_servers(ctx, sq);
+	txq_for_each(&ctx->txq, ns_handover_put_msg, &state);
+	if (state.rc)
+		return state.rc;
+	hdr.msgs = state.msgs;
 
-	return rc;
+	memcpy(hb->data, &hdr, sizeof(hdr));
+
+	return 0;
 }
 
-static int ctrl_cmd_bye(struct context *ctx, struct sockaddr_qrtr *from)
+static int ns_handover_load(struct context *ctx, struct handover_buf *hb)
 {
-	struct qrtr_ctrl_pkt pkt;
+	struct ns_handover_hdr hdr;
+	struct ns_handover_msg msg;
 	struct sockaddr_qrtr sq;
-	struct node *local_node;
-	struct map_entry *me;
-	struct server *srv;
-	struct node *node;
+	unsigned int i;
 	int rc;
 
-	node = node_get(from->sq_node);
-	if (!node)
-		return 0;
-
-	map_for_each(&node->services, me) {
-		srv = map_iter_data(me, struct server, mi);
+	rc = handover_get(hb, &hdr, sizeof(hdr));
+	if (rc)
+		return rc;
 
-		server_del(ctx, node, srv->port);
+	if (hdr.magic != NS_HANDOVER_MAGIC ||
+	    hdr.version != NS_HANDOVER_VERSION) {
+		LOGW("unknown handover state version %u", hdr.version);
+		return -EPROTO;
 	}
 
-	/* Advertise the removal of this client to all local services */
-	local_node = node_get(ctx->local_node);
-	if (!local_node)
-		return 0;
+	if (hb->len - hb->off < hdr.state_len)
+		return -EPROTO;
 
-	memset(&pkt, 0, sizeof(pkt));
-	pkt.cmd = QRTR_TYPE_BYE;
-	pkt.client.node = from->sq_node;
+	rc = qrtr_ns_state_load(ctx->ns, hb->data + hb->off, hdr.state_len,
+				false);
+	if (rc < 0)
+		return rc;
+	hb->off += hdr.state_len;
 
-	map_for_each(&local_node->services, me) {
-		srv = map_iter_data(me, struct server, mi);
+	sq.sq_family = AF_QIPCRTR;
+	for (i = 0; i < hdr.msgs; i++) {
+		rc = handover_get(hb, &msg, sizeof(msg));
+		if (rc)
+			return rc;
 
-		sq.sq_family = AF_QIPCRTR;
-		sq.sq_node = srv->node;
-		sq.sq_port = srv->port;
+		if (hb->len - hb->off < msg.len)
+			return -EPROTO;
 
-		rc = sendto(ctx->sock, &pkt, sizeof(pkt), 0,
-				(struct sockaddr *)&sq, sizeof(sq));
-		if (rc < 0)
-			PLOGW("bye propagation failed");
+		sq.sq_node = msg.node;
+		sq.sq_port = msg.port;
+		if (ns_sendto(ctx, &sq, hb->data + hb->off, msg.len) < 0)
+			PLOGW("sendto(%u:%u)", msg.node, msg.port);
+		hb->off += msg.len;
 	}
 
+	LOGD("took over %u queued messages\n", hdr.msgs);
+
 	return 0;
 }
 
-static int ctrl_cmd_del_client(struct context *ctx, struct sockaddr_qrtr *from,
-			       unsigned node_id, unsigned port)
-{
-	struct qrtr_ctrl_pkt pkt;
-	struct sockaddr_qrtr sq;
-	struct node *local_node;
-	struct list_item *tmp;
-	struct lookup *lookup;
-	struct list_item *li;
-	struct map_entry *me;
-	struct server *srv;
-	struct node *node;
-	int rc;
+static void handover_fn(void *vcontext, struct waiter_ticket *tkt);
 
-	/* Don't accept spoofed messages */
-	if (from->sq_node != node_id)
-		return -EINVAL;
+static void ns_handover_listen(struct context *ctx)
+{
+	ctx->handover_sock = handover_listen();
+	if (ctx->handover_sock < 0) {
+		PLOGW("unable to listen for handovers");
+		return;
+	}
 
-	/* Local DEL_CLIENT messages comes from the port being closed */
-	if (from->sq_node == ctx->local_node && from->sq_port != port)
-		return -EINVAL;
+	waiter_ticket_set_fd(ctx->handover_tkt, ctx->handover_sock);
+	waiter_ticket_callback(ctx->handover_tkt, handover_fn, ctx);
+}
 
-	/* Remove any lookups by this client */
-	list_for_each_safe(&ctx->lookups, li, tmp) {
-		lookup = container_of(li, struct lookup, li);
-		if (lookup->sq.sq_node != node_id)
-			continue;
-		if (lookup->sq.sq_port != port)
-			continue;
+/*
+ * A new instance asks to take over. Unread messages stay queued on the
+ * control socket, which is passed along with the state, so nothing is lost
+ * while neither instance is reading.
+ */
+static void handover_fn(void *vcontext, struct waiter_ticket *tkt)
+{
+	struct context *ctx = vcontext;
+	struct handover_buf hb = {};
+	int fd;
+	int rc;
 
-		list_remove(&ctx->lookups, &lookup->li);
-		free(lookup);
-	}
+	fd = handover_accept(ctx->handover_sock);
+	if (fd < 0)
+		goto out;
 
-	/* Remove the server belonging to this port*/
-	node = node_get(node_id);
-	if (node)
-		server_del(ctx, node, port);
+	ns_io_stop(ctx);
 
-	/* Advertise the removal of this client to all local services */
-	local_node = node_get(ctx->local_node);
-	if (!local_node)
-		return 0;
+	/* The new instance listens once it's serving */
+	close(ctx->handover_sock);
+	ctx->handover_sock = -1;
+	waiter_ticket_set_null(tkt);
 
-	pkt.cmd = QRTR_TYPE_DEL_CLIENT;
-	pkt.client.node = node_id;
-	pkt.client.port = port;
+	rc = ns_handover_save(ctx, &hb);
+	if (!rc)
+		rc = handover_send(fd, ctx->sock, &hb) ? -errno : 0;
+	if (!rc)
+		rc = handover_wait_ack(fd, HANDOVER_TIMEOUT_MS) ? -errno : 0;
 
-	map_for_each(&local_node->services, me) {
-		srv = map_iter_data(me, struct server, mi);
+	handover_buf_free(&hb);
+	close(fd);
 
-		sq.sq_family = AF_QIPCRTR;
-		sq.sq_node = srv->node;
-		sq.sq_port = srv->port;
+	if (!rc) {
+		LOGD("handed over, exiting\n");
 
-		rc = sendto(ctx->sock, &pkt, sizeof(pkt), 0,
-				(struct sockaddr *)&sq, sizeof(sq));
-		if (rc < 0)
-			PLOGW("del_client propagation failed");
+		/* Queued messages went along */
+		txq_destroy(&ctx->txq);
+		close(ctx->sock);
+		ctx->sock = -1;
+		goto out;
 	}
 
-	return 0;
-}
+	LOGW("handover failed: %s", strerror(-rc));
 
-static int ctrl_cmd_new_server(struct context *ctx, struct sockaddr_qrtr *from,
-			       unsigned int service, unsigned int instance,
-			       unsigned int node_id, unsigned int port)
-{
-	struct lookup *lookup;
-	struct list_item *li;
-	struct server *srv;
-	int rc = 0;
-
-	/* Ignore specified node and port for local servers*/
-	if (from->sq_node == ctx->local_node) {
-		node_id = from->sq_node;
-		port = from->sq_port;
-	}
+	ns_handover_listen(ctx);
+	if (ns_io_start(ctx) < 0)
+		LOGE_AND_EXIT("unable to resume serving");
 
-	/* Don't accept spoofed messages */
-	if (from->sq_node != node_id)
-		return -EINVAL;
+out:
+	waiter_ticket_clear(tkt);
+}
 
-	srv = server_add(service, instance, node_id, port);
-	if (!srv)
-		return -EINVAL;
+#define NS_CHECKPOINT_MAGIC	0x716e7363
+#define NS_CHECKPOINT_VERSION	2
 
-	if (srv->node == ctx->local_node)
-		rc = service_announce_new(ctx, &ctx->bcast_sq, srv);
+/* Followed by the name service state */
+struct ns_checkpoint_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t local_node;
+	uint32_t state_len;
+	uint32_t checksum;
+};
 
-	list_for_each(&ctx->lookups, li) {
-		lookup = container_of(li, struct lookup, li);
-		if (lookup->service && lookup->service != service)
-			continue;
-		if (lookup->instance && lookup->instance != instance)
-			continue;
+static int ns_checkpoint_save(struct context *ctx)
+{
+	struct ns_checkpoint_hdr hdr;
+	struct handover_buf hb = {};
+	void *data;
+	size_t len;
+	int rc;
 
-		lookup_notify(ctx, &lookup->sq, srv, true);
-	}
+	rc = qrtr_ns_state_save(ctx->ns, &data, &len);
+	if (rc)
+		return rc;
 
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NS_CHECKPOINT_MAGIC;
+	hdr.version = NS_CHECKPOINT_VERSION;
+	hdr.local_node = ctx->local_node;
+	hdr.state_len = len;
+	hdr.checksum = hash_mem(data, len);
+
+	rc = handover_put(&hb, &hdr, sizeof(hdr));
+	if (!rc)
+		rc = handover_put(&hb, data, len);
+	if (!rc)
+		rc = checkpoint_write(ctx->ckpt_path, hb.data, hb.len);
+	if (!rc)
+		qrtr_ns_state_clean(ctx->ns);
+
+	free(data);
+	handover_buf_free(&hb);
 	return rc;
 }
 
-static int ctrl_cmd_del_server(struct context *ctx, struct sockaddr_qrtr *from,
-			       unsigned int service, unsigned int instance,
-			       unsigned int node_id, unsigned int port)
+/*
+ * Restores the registry and the lookups from the last checkpoint, so
+ * services resolve right away. Servers of remote nodes are only trusted
+ * until they had a chance to re-announce them in response to our HELLO.
+ * Local ports are probed, entries of ports closed meanwhile are dropped.
+ *
+ * Return: The number of servers awaiting confirmation.
+ */
+static unsigned int ns_checkpoint_load(struct context *ctx)
 {
-	struct node *node;
+	const struct ns_checkpoint_hdr *hdr;
+	unsigned int stale = 0;
+	const void *data;
+	size_t len;
+	int rc;
 
-	/* Ignore specified node and port for local servers*/
-	if (from->sq_node == ctx->local_node) {
-		node_id = from->sq_node;
-		port = from->sq_port;
+	data = checkpoint_map(ctx->ckpt_path, &len);
+	if (!data)
+		return 0;
+
+	hdr = data;
+	if (len < sizeof(*hdr) || hdr->magic != NS_CHECKPOINT_MAGIC ||
+	    hdr->version != NS_CHECKPOINT_VERSION) {
+		LOGW("ignoring unknown checkpoint %s", ctx->ckpt_path);
+		goto out;
 	}
 
-	/* Don't accept spoofed messages */
-	if (from->sq_node != node_id)
-		return -EINVAL;
+	if (hdr->local_node != (uint32_t)ctx->local_node) {
+		LOGW("ignoring checkpoint of node %u", hdr->local_node);
+		goto out;
+	}
 
-	/* Local servers may only unregister themselves */
-	if (from->sq_node == ctx->local_node && from->sq_port != port)
-		return -EINVAL;
+	if (len - sizeof(*hdr) != hdr->state_len ||
+	    hash_mem(hdr + 1, hdr->state_len) != hdr->checksum) {
+		LOGW("ignoring corrupt checkpoint %s", ctx->ckpt_path);
+		goto out;
+	}
 
-	node = node_get(node_id);
-	if (!node)
-		return -ENOENT;
+	ctx->probe_sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+	if (ctx->probe_sock < 0)
+		PLOGW("unable to create socket for probing local ports");
 
-	return server_del(ctx, node, port);
-}
+	rc = qrtr_ns_state_load(ctx->ns, hdr + 1, hdr->state_len, true);
 
-static int ctrl_cmd_new_lookup(struct context *ctx, struct sockaddr_qrtr *from,
-			       unsigned int service, unsigned int instance)
-{
-	struct server_filter filter;
-	struct list reply_list;
-	struct lookup *lookup;
-	struct list_item *li;
-	struct server *srv;
-
-	/* Accept only local observers */
-	if (from->sq_node != ctx->local_node)
-		return -EINVAL;
-
-	lookup = calloc(1, sizeof(*lookup));
-	if (!lookup)
-		return -EINVAL;
-
-	lookup->sq = *from;
-	lookup->service = service;
-	lookup->instance = instance;
-	list_append(&ctx->lookups, &lookup->li);
-
-	memset(&filter, 0, sizeof(filter));
-	filter.service = service;
-	filter.instance = instance;
-
-	server_query(&filter, &reply_list);
-	list_for_each(&reply_list, li) {
-		srv = container_of(li, struct server, qli);
-
-		lookup_notify(ctx, from, srv, true);
+	if (ctx->probe_sock >= 0) {
+		close(ctx->probe_sock);
+		ctx->probe_sock = -1;
 	}
 
-	lookup_notify(ctx, from, NULL, true);
+	if (rc < 0) {
+		LOGW("unable to restore checkpoint %s: %s", ctx->ckpt_path,
+		     strerror(-rc));
+		goto out;
+	}
+	stale = rc;
 
-	return 0;
-}
+	LOGD("restored checkpoint %s\n", ctx->ckpt_path);
 
-static int ctrl_cmd_del_lookup(struct context *ctx, struct sockaddr_qrtr *from,
-			       unsigned int service, unsigned int instance)
-{
-	struct lookup *lookup;
-	struct list_item *tmp;
-	struct list_item *li;
-
-	list_for_each_safe(&ctx->lookups, li, tmp) {
-		lookup = container_of(li, struct lookup, li);
-		if (lookup->sq.sq_node != from->sq_node)
-			continue;
-		if (lookup->sq.sq_port != from->sq_port)
-			continue;
-		if (lookup->service != service)
-			continue;
-		if (lookup->instance && lookup->instance != instance)
-			continue;
-
-		list_remove(&ctx->lookups, &lookup->li);
-		free(lookup);
-	}
+	/* Nothing new to write */
+	qrtr_ns_state_clean(ctx->ns);
 
-	return 0;
+out:
+	checkpoint_unmap(data, len);
+	return stale;
 }
 
-static void ctrl_port_fn(void *vcontext, struct waiter_ticket *tkt)
+static void checkpoint_fn(void *vcontext, struct waiter_ticket *tkt)
 {
 	struct context *ctx = vcontext;
-	struct sockaddr_qrtr sq;
-	int sock = ctx->sock;
-	struct qrtr_ctrl_pkt *msg;
-	unsigned int cmd;
-	char buf[4096];
-	socklen_t sl;
-	ssize_t len;
 	int rc;
 
-	sl = sizeof(sq);
-	len = recvfrom(sock, buf, sizeof(buf), 0, (void *)&sq, &sl);
-	if (len <= 0) {
-		PLOGW("recvfrom()");
-		close(sock);
-		ctx->sock = -1;
-		goto out;
+	if (qrtr_ns_state_dirty(ctx->ns)) {
+		rc = ns_checkpoint_save(ctx);
+		if (rc < 0)
+			LOGW("unable to write checkpoint %s: %s",
+			     ctx->ckpt_path, strerror(-rc));
 	}
-	msg = (void *)buf;
 
-	if (len < 4) {
-		LOGW("short packet from %u:%u", sq.sq_node, sq.sq_port);
-		goto out;
-	}
+	waiter_ticket_clear(tkt);
+}
 
-	cmd = le32_to_cpu(msg->cmd);
-	if (cmd < ARRAY_SIZE(ctrl_pkt_strings) && ctrl_pkt_strings[cmd])
-		LOGD("%s from %u:%u\n", ctrl_pkt_strings[cmd], sq.sq_node, sq.sq_port);
-	else
-		LOGD("UNK (%08x) from %u:%u\n", cmd, sq.sq_node, sq.sq_port);
-
-	rc = 0;
-	switch (cmd) {
-	case QRTR_TYPE_HELLO:
-		rc = ctrl_cmd_hello(ctx, &sq, buf, len);
-		break;
-	case QRTR_TYPE_BYE:
-		rc = ctrl_cmd_bye(ctx, &sq);
-		break;
-	case QRTR_TYPE_DEL_CLIENT:
-		rc = ctrl_cmd_del_client(ctx, &sq,
-					 le32_to_cpu(msg->client.node),
-					 le32_to_cpu(msg->client.port));
-		break;
-	case QRTR_TYPE_NEW_SERVER:
-		rc = ctrl_cmd_new_server(ctx, &sq,
-					 le32_to_cpu(msg->server.service),
-					 le32_to_cpu(msg->server.instance),
-					 le32_to_cpu(msg->server.node),
-					 le32_to_cpu(msg->server.port));
-		break;
-	case QRTR_TYPE_DEL_SERVER:
-		rc = ctrl_cmd_del_server(ctx, &sq,
-					 le32_to_cpu(msg->server.service),
-					 le32_to_cpu(msg->server.instance),
-					 le32_to_cpu(msg->server.node),
-					 le32_to_cpu(msg->server.port));
-		break;
-	case QRTR_TYPE_EXIT:
-	case QRTR_TYPE_PING:
-	case QRTR_TYPE_RESUME_TX:
-		break;
-	case QRTR_TYPE_NEW_LOOKUP:
-		rc = ctrl_cmd_new_lookup(ctx, &sq,
-					 le32_to_cpu(msg->server.service),
-					 le32_to_cpu(msg->server.instance));
-		break;
-	case QRTR_TYPE_DEL_LOOKUP:
-		rc = ctrl_cmd_del_lookup(ctx, &sq,
-					 le32_to_cpu(msg->server.service),
-					 le32_to_cpu(msg->server.instance));
-		break;
-	}
+/* Drops the restored servers which weren't announced again in time */
+static void checkpoint_sweep_fn(void *vcontext, struct waiter_ticket *tkt)
+{
+	struct context *ctx = vcontext;
+	unsigned int swept;
 
-	if (rc < 0)
-		LOGW("failed while handling packet from %u:%u",
-		      sq.sq_node, sq.sq_port);
-out:
+	swept = qrtr_ns_sweep_stale(ctx->ns);
+	if (swept)
+		LOGW("dropped %u servers not announced again since restart",
+		     swept);
+
+	txq_arm(ctx);
+
+	waiter_ticket_set_null(tkt);
 	waiter_ticket_clear(tkt);
 }
 
-static int say_hello(struct context *ctx)
+static void go_dormant(int sock)
 {
-	struct qrtr_ctrl_pkt pkt;
-	int rc;
+	close(sock);
+
+	for (;;)
+		sleep(UINT_MAX);
+}
 
-	memset(&pkt, 0, sizeof(pkt));
-	pkt.cmd = cpu_to_le32(QRTR_TYPE_HELLO);
+/* Comma separated <limit>=<n>, limits as in struct qrtr_ns_limits */
+static int parse_limits(char *arg, struct qrtr_ns_limits *limits)
+{
+	char *const tokens[] = {
+		"client-rate", "client-burst", "node-rate", "node-burst",
+		"lookups", "servers", NULL
+	};
+	unsigned int *fields[] = {
+		&limits->client_rate, &limits->client_burst,
+		&limits->node_rate, &limits->node_burst,
+		&limits->max_lookups, &limits->max_servers,
+	};
+	unsigned long val;
+	char *value;
+	char *ep;
+	int idx;
 
-	rc = sendto(ctx->sock, &pkt, sizeof(pkt), 0,
-		    (struct sockaddr *)&ctx->bcast_sq, sizeof(ctx->bcast_sq));
-	if (rc < 0)
-		return rc;
+	while (*arg) {
+		idx = getsubopt(&arg, tokens, &value);
+		if (idx < 0 || !value)
+			return -1;
+
+		val = strtoul(value, &ep, 10);
+		if (*value == '\0' || *ep != '\0' || val > UINT_MAX)
+			return -1;
+
+		*fields[idx] = val;
+	}
 
 	return 0;
 }
 
-static void server_mi_free(struct map_item *mi)
+/* Dumps the trace ring on SIGUSR1, for qrtr-ns-trace to render */
+static void trace_signal_fn(void *vcontext, struct waiter_ticket *tkt)
 {
-	free(container_of(mi, struct server, mi));
-}
+	struct context *ctx = vcontext;
+	struct signalfd_siginfo si;
+	void *data;
+	size_t len;
+	int rc;
 
-static void node_mi_free(struct map_item *mi)
-{
-	struct node *node = container_of(mi, struct node, mi);
+	if (read(ctx->trace_fd, &si, sizeof(si)) != sizeof(si))
+		goto out;
 
-	map_clear(&node->services, server_mi_free);
-	map_destroy(&node->services);
+	rc = qrtr_ns_trace_save(ctx->ns, &data, &len);
+	if (!rc) {
+		rc = checkpoint_write(ctx->trace_path, data, len);
+		free(data);
+	}
 
-	free(node);
+	if (rc < 0)
+		LOGW("unable to dump trace to %s: %s", ctx->trace_path,
+		     strerror(-rc));
+	else
+		qlog(LOG_INFO, "trace dumped to %s", ctx->trace_path);
+out:
+	waiter_ticket_clear(tkt);
 }
 
-static void go_dormant(int sock)
+/* Must run before starting threads, so SIGUSR1 is blocked in all of them */
+static int ns_trace_listen(struct context *ctx, struct waiter *w)
 {
-	close(sock);
+	struct waiter_ticket *tkt;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+		return -1;
+
+	ctx->trace_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (ctx->trace_fd < 0)
+		return -1;
+
+	tkt = waiter_add_fd(w, ctx->trace_fd);
+	if (!tkt) {
+		close(ctx->trace_fd);
+		ctx->trace_fd = -1;
+		return -1;
+	}
 
-	for (;;)
-		sleep(UINT_MAX);
+	waiter_ticket_callback(tkt, trace_signal_fn, ctx);
+
+	return 0;
 }
 
 static void usage(const char *progname)
 {
-	fprintf(stderr, "%s [-f] [-s] [<node-id>]\n", progname);
+	fprintf(stderr, "%s [-a] [-c <checkpoint>] [-d <trace>] [-f] [-i] [-l <limit>=<n>[,...]] [-r] [-s] [-t] [-v] [<node-id>]\n",
+		progname);
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
 	struct waiter_ticket *tkt;
+	struct handover_buf hb;
 	struct sockaddr_qrtr sq;
 	struct context ctx;
 	unsigned long addr = (unsigned long)-1;
@@ -708,20 +735,52 @@ int main(int argc, char **argv)
 	socklen_t sl = sizeof(sq);
 	bool foreground = false;
 	bool use_syslog = false;
+	bool async_log = false;
 	bool verbose_log = false;
+	bool use_sender = false;
+	bool takeover = false;
+	bool resync = false;
+	struct qrtr_ns_limits limits = {};
+	struct qrtr_ns_stats stats;
+	const char *ckpt_path = NULL;
+	const char *trace_path = NULL;
+	unsigned int stale = 0;
+	int handover_fd = -1;
 	char *ep;
 	int opt;
 	int rc;
 	const char *progname = basename(argv[0]);
 
-	while ((opt = getopt(argc, argv, "fsv")) != -1) {
+	while ((opt = getopt(argc, argv, "ac:d:fil:rstv")) != -1) {
 		switch (opt) {
+		case 'a':
+			async_log = true;
+			break;
+		case 'c':
+			ckpt_path = optarg;
+			break;
+		case 'd':
+			trace_path = optarg;
+			break;
 		case 'f':
 			foreground = true;
 			break;
+		case 'i':
+			resync = true;
+			break;
+		case 'l':
+			if (parse_limits(optarg, &limits))
+				usage(progname);
+			break;
+		case 'r':
+			takeover = true;
+			break;
 		case 's':
 			use_syslog = true;
 			break;
+		case 't':
+			use_sender = true;
+			break;
 		case 'v':
 			verbose_log = true;
 			break;
@@ -750,15 +809,26 @@ int main(int argc, char **argv)
 	if (w == NULL)
 		LOGE_AND_EXIT("unable to create waiter");
 
-	list_init(&ctx.lookups);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.use_sender = use_sender;
+	ctx.probe_sock = -1;
+	ctx.handover_sock = -1;
+	ctx.trace_fd = -1;
 
-	rc = map_create(&nodes);
-	if (rc)
-		LOGE_AND_EXIT("unable to create node map");
+	if (takeover) {
+		handover_fd = handover_connect();
+		if (handover_fd < 0)
+			PLOGW("no nameserver to take over from");
+	}
 
-	ctx.sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
-	if (ctx.sock < 0)
-		PLOGE_AND_EXIT("unable to create control socket");
+	if (handover_fd >= 0) {
+		if (handover_recv(handover_fd, &ctx.sock, &hb) < 0)
+			PLOGE_AND_EXIT("unable to take over control socket");
+	} else {
+		ctx.sock = socket(AF_QIPCRTR, SOCK_DGRAM, 0);
+		if (ctx.sock < 0)
+			PLOGE_AND_EXIT("unable to create control socket");
+	}
 
 	rc = getsockname(ctx.sock, (void*)&sq, &sl);
 	if (rc < 0)
@@ -766,23 +836,41 @@ int main(int argc, char **argv)
 	sq.sq_port = QRTR_PORT_CTRL;
 	ctx.local_node = sq.sq_node;
 
-	rc = bind(ctx.sock, (void *)&sq, sizeof(sq));
-	if (rc < 0) {
-		if (errno == EADDRINUSE) {
-			PLOGE("nameserver already running, going dormant");
-			go_dormant(ctx.sock);
+	if (rxq_init(&ctx.rxq, ctx.local_node) < 0)
+		LOGE_AND_EXIT("unable to allocate receive queues");
+
+	ctx.ns = qrtr_ns_create(ctx.local_node, &ns_ops, &ctx);
+	if (!ctx.ns)
+		LOGE_AND_EXIT("unable to create name service");
+	qrtr_ns_set_resync(ctx.ns, resync);
+	qrtr_ns_set_limits(ctx.ns, &limits);
+
+	/* A socket taken over is bound already */
+	if (handover_fd < 0) {
+		rc = bind(ctx.sock, (void *)&sq, sizeof(sq));
+		if (rc < 0) {
+			if (errno == EADDRINUSE) {
+				PLOGE("nameserver already running, going dormant");
+				go_dormant(ctx.sock);
+			}
+
+			PLOGE_AND_EXIT("bind control socket");
 		}
-
-		PLOGE_AND_EXIT("bind control socket");
 	}
 
-	ctx.bcast_sq.sq_family = AF_QIPCRTR;
-	ctx.bcast_sq.sq_node = QRTR_NODE_BCAST;
-	ctx.bcast_sq.sq_port = QRTR_PORT_CTRL;
+	txq_init(&ctx.txq, ctx.sock);
 
-	rc = say_hello(&ctx);
-	if (rc)
-		PLOGE_AND_EXIT("unable to say hello");
+	/* Taking over carries the exact state instead */
+	ctx.ckpt_path = ckpt_path;
+	if (ctx.ckpt_path && handover_fd < 0)
+		stale = ns_checkpoint_load(&ctx);
+
+	/* Peers know us already when taking over */
+	if (handover_fd < 0) {
+		rc = qrtr_ns_say_hello(ctx.ns);
+		if (rc)
+			PLOGE_AND_EXIT("unable to say hello");
+	}
 
 	/* If we're going to background, fork and exit parent */
 	if (!foreground && fork() != 0) {
@@ -790,18 +878,73 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
-	tkt = waiter_add_fd(w, ctx.sock);
-	waiter_ticket_callback(tkt, ctrl_port_fn, &ctx);
+	/* The logging thread must be started in the process that stays */
+	if (async_log && qlog_start_async() < 0)
+		LOGW("unable to log asynchronously");
+
+	ctx.ctrl_tkt = waiter_add_null(w);
+	ctx.txq_tkt = waiter_add_null(w);
+	waiter_ticket_callback(ctx.txq_tkt, txq_fn, &ctx);
+	ctx.handover_tkt = waiter_add_null(w);
+
+	if (ctx.ckpt_path) {
+		tkt = waiter_add_timeout(w, CHECKPOINT_INTERVAL_MS);
+		waiter_ticket_callback(tkt, checkpoint_fn, &ctx);
+	}
+
+	if (stale) {
+		tkt = waiter_add_timeout(w, CHECKPOINT_GRACE_MS);
+		waiter_ticket_callback(tkt, checkpoint_sweep_fn, &ctx);
+	}
+
+	ctx.trace_path = trace_path;
+	if (ctx.trace_path && ns_trace_listen(&ctx, w) < 0)
+		PLOGE_AND_EXIT("unable to handle SIGUSR1");
+
+	if (ns_io_start(&ctx) < 0)
+		LOGE_AND_EXIT("unable to create sender thread");
+
+	if (handover_fd >= 0) {
+		rc = ns_handover_load(&ctx, &hb);
+		handover_buf_free(&hb);
+		if (rc < 0)
+			LOGE_AND_EXIT("unable to take over state: %s",
+				      strerror(-rc));
+	}
+
+	ns_handover_listen(&ctx);
+
+	if (handover_fd >= 0) {
+		if (handover_ack(handover_fd) < 0)
+			PLOGE_AND_EXIT("unable to complete takeover");
+		close(handover_fd);
+	}
+
+	txq_arm(&ctx);
 
 	while (ctx.sock >= 0)
 		waiter_wait(w);
 
 	puts("exiting cleanly");
 
+	ns_io_stop(&ctx);
+	if (ctx.handover_sock >= 0)
+		close(ctx.handover_sock);
+	if (ctx.trace_fd >= 0)
+		close(ctx.trace_fd);
+	txq_destroy(&ctx.txq);
+	rxq_destroy(&ctx.rxq);
+
 	waiter_destroy(w);
 
-	map_clear(&nodes, node_mi_free);
-	map_destroy(&nodes);
+	qrtr_ns_get_stats(ctx.ns, &stats);
+	if (stats.rate_limited || stats.lookups_capped || stats.servers_capped)
+		qlog(LOG_INFO, "refused %lu packets over rate, %lu lookups and %lu servers over cap",
+		     stats.rate_limited, stats.lookups_capped,
+		     stats.servers_capped);
+
+	qrtr_ns_destroy(ctx.ns);
 
 	return 0;
 }
+
@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <libgen.h>
+#include <libqrtr-ns.h>
+#include <linux/qrtr.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ns.h"
+
+#define BENCH_LOCAL_NODE	1
+#define BENCH_REMOTE_NODE	2
+#define BENCH_SERVICES		64
+
+static unsigned long sent;
+
+static int bench_send(void *data, const struct sockaddr_qrtr *to,
+		      const void *buf, size_t len)
+{
+	sent++;
+	return len;
+}
+
+/* Local ports restored from a checkpoint are all still open */
+static int bench_probe(void *data, unsigned int node, unsigned int port)
+{
+	return 0;
+}
+
+static const struct qrtr_ns_ops bench_ops = {
+	.send = bench_send,
+	.probe = bench_probe,
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_packet(struct qrtr_ns *ns, unsigned int node,
+			unsigned int port, unsigned int cmd,
+			unsigned int service, unsigned int instance,
+			unsigned int srv_port)
+{
+	struct sockaddr_qrtr from = {
+		.sq_family = AF_QIPCRTR,
+		.sq_node = node,
+		.sq_port = port,
+	};
+	struct qrtr_ctrl_pkt pkt = {};
+
+	pkt.cmd = cpu_to_le32(cmd);
+	pkt.server.service = cpu_to_le32(service);
+	pkt.server.instance = cpu_to_le32(instance);
+	pkt.server.node = cpu_to_le32(node);
+	pkt.server.port = cpu_to_le32(srv_port);
+
+	return qrtr_ns_process_packet(ns, &from, &pkt, sizeof(pkt));
+}
+
+static void bench_report(const char *name, unsigned int count, uint64_t ns)
+{
+	printf("%-16s %8u packets %10.1f ns/packet\n", name, count,
+	       (double)ns / count);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "%s [-n <servers>] [-i <iterations>]\n", progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iterations = 10000;
+	unsigned int servers = 1000;
+	struct qrtr_ns *ns;
+	unsigned int dropped;
+	char *progname;
+	size_t len;
+	void *state;
+	int stale;
+	uint64_t start;
+	unsigned int i;
+	int opt;
+
+	progname = basename(argv[0]);
+
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			servers = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+
+	if (!iterations || !servers)
+		usage(progname);
+
+	ns = qrtr_ns_create(BENCH_LOCAL_NODE, &bench_ops, NULL);
+	if (!ns) {
+		fprintf(stderr, "failed to create name service\n");
+		return 1;
+	}
+
+	/* Remote servers spread over a few services, as announced by a peer */
+	start = bench_now();
+	for (i = 0; i < servers; i++) {
+		if (bench_packet(ns, BENCH_REMOTE_NODE, QRTR_PORT_CTRL,
+				 QRTR_TYPE_NEW_SERVER, 1 + i % BENCH_SERVICES,
+				 i, 0x4000 + i) < 0) {
+			fprintf(stderr, "failed to register server %u\n", i);
+			return 1;
+		}
+	}
+	bench_report("new-server", servers, bench_now() - start);
+
+	/* A local client looking up a service, then going away */
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		bench_packet(ns, BENCH_LOCAL_NODE, 0x100, QRTR_TYPE_NEW_LOOKUP,
+			     1 + i % BENCH_SERVICES, 0, 0);
+		bench_packet(ns, BENCH_LOCAL_NODE, 0x100, QRTR_TYPE_DEL_LOOKUP,
+			     1 + i % BENCH_SERVICES, 0, 0);
+	}
+	bench_report("lookup", 2 * iterations, bench_now() - start);
+
+	/* Churn of one remote server, invalidating its cached lookups */
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		bench_packet(ns, BENCH_REMOTE_NODE, QRTR_PORT_CTRL,
+			     QRTR_TYPE_DEL_SERVER, 1, 0, 0x4000);
+		bench_packet(ns, BENCH_REMOTE_NODE, QRTR_PORT_CTRL,
+			     QRTR_TYPE_NEW_SERVER, 1, 0, 0x4000);
+	}
+	bench_report("server-churn", 2 * iterations, bench_now() - start);
+
+	/* Local servers, alive across a restart of the name service */
+	for (i = 0; i < BENCH_SERVICES; i++)
+		bench_packet(ns, BENCH_LOCAL_NODE, 0x200 + i, QRTR_TYPE_NEW_SERVER,
+			     1 + i, 0, 0x200 + i);
+
+	if (qrtr_ns_state_save(ns, &state, &len) < 0) {
+		fprintf(stderr, "failed to save state\n");
+		return 1;
+	}
+	qrtr_ns_destroy(ns);
+
+	ns = qrtr_ns_create(BENCH_LOCAL_NODE, &bench_ops, NULL);
+	if (!ns) {
+		fprintf(stderr, "failed to create name service\n");
+		return 1;
+	}
+
+	/* Only the remote servers await being announced again */
+	start = bench_now();
+	stale = qrtr_ns_state_load(ns, state, len, true);
+	dropped = qrtr_ns_sweep_stale(ns);
+	bench_report("restore", servers + BENCH_SERVICES, bench_now() - start);
+	free(state);
+
+	if (stale != (int)servers || dropped != servers) {
+		fprintf(stderr, "restore left %d stale, swept %u of %u servers\n",
+			stale, dropped, servers);
+		return 1;
+	}
+
+	qrtr_ns_destroy(ns);
+
+	printf("%lu control messages sent\n", sent);
+
+	return 0;
+}
@@ -0,0 +1,2469 @@
+#include <errno.h>
+#include <libqrtr-ns.h>
+#include <limits.h>
+#include <linux/qrtr.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "handover.h"
+#include "hash.h"
+#include "list.h"
+#include "map.h"
+#include "ns.h"
+#include "probe.h"
+#include "resync.h"
+#include "trace.h"
+#include "util.h"
+
+#include "logging.h"
+
+static const char *ctrl_pkt_strings[] = {
+	[QRTR_TYPE_HELLO]	= "hello",
+	[QRTR_TYPE_BYE]		= "bye",
+	[QRTR_TYPE_NEW_SERVER]	= "new-server",
+	[QRTR_TYPE_DEL_SERVER]	= "del-server",
+	[QRTR_TYPE_DEL_CLIENT]	= "del-client",
+	[QRTR_TYPE_RESUME_TX]	= "resume-tx",
+	[QRTR_TYPE_EXIT]	= "exit",
+	[QRTR_TYPE_PING]	= "ping",
+	[QRTR_TYPE_NEW_LOOKUP]	= "new-lookup",
+	[QRTR_TYPE_DEL_LOOKUP]	= "del-lookup",
+};
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
+
+#define LOOKUP_CACHE_SIZE	16
+#define SERVICE_GEN_BUCKETS	64
+
+struct server_filter {
+	unsigned int service;
+	unsigned int instance;
+	unsigned int ifilter;
+	unsigned int imin;
+	unsigned int imax;
+};
+
+struct lookup_cache_entry {
+	struct server_filter filter;
+	unsigned int gen;
+	unsigned long last_used;
+
+	unsigned int count;
+	struct qrtr_server_rec *recs;
+};
+
+struct qrtr_ns {
+	unsigned int local_node;
+
+	struct sockaddr_qrtr bcast_sq;
+
+	struct list lookups;
+
+	/* Transport, provided by whoever hosts the name service */
+	const struct qrtr_ns_ops *ops;
+	void *data;
+
+	/* Lookups or servers changed since the state was last saved */
+	bool dirty;
+
+	/*
+	 * Bumped on every registry change, globally and in the bucket of the
+	 * service, invalidating cached lookup results
+	 */
+	unsigned int gen;
+	unsigned int service_gen[SERVICE_GEN_BUCKETS];
+
+	struct lookup_cache_entry lookup_cache[LOOKUP_CACHE_SIZE];
+	unsigned long lookup_tick;
+
+	struct map nodes;
+
+	/* Servers of each service, sorted by instance */
+	struct map services;
+
+	/* Incremental resync with other name services, when enabled */
+	bool resync;
+	struct resync_log rlog;
+
+	/* Admission control, see ns_admit() */
+	struct qrtr_ns_limits limits;
+	struct qrtr_ns_stats stats;
+
+	/* Last control packets handled, for postmortem debugging */
+	struct ns_trace trace;
+};
+
+struct lookup {
+	struct server_filter filter;
+
+	struct sockaddr_qrtr sq;
+	struct list_item li;
+};
+
+struct server {
+	unsigned int service;
+	unsigned int instance;
+
+	unsigned int node;
+	unsigned int port;
+	struct map_item mi;
+
+	/* Position in the servers array of the node */
+	unsigned int slot;
+
+	/* Restored from a checkpoint, not announced again since */
+	bool stale;
+};
+
+/*
+ * Servers along with their service and instance stored contiguously, so
+ * that queries can compare several of them at once without dereferencing
+ * each server.
+ */
+struct server_array {
+	unsigned int count;
+	unsigned int size;
+
+	uint32_t *service;
+	uint32_t *instance;
+	struct server **srvs;
+};
+
+/* Tokens are counted in thousandths, refilled every millisecond */
+struct token_bucket {
+	uint64_t tokens;
+	uint64_t last;
+};
+
+/* Admission state of a port, only tracked when rate limited */
+struct client {
+	struct token_bucket tb;
+
+	struct map_item mi;
+};
+
+struct node {
+	unsigned int id;
+
+	struct map_item mi;
+	struct map services;
+
+	/* Clients of the node, by port */
+	struct map clients;
+	struct token_bucket tb;
+
+	/* Unordered, servers know their slot */
+	struct server_array servers;
+
+	/* Registry of the node's name service we're in sync with */
+	uint32_t epoch;
+	uint32_t gen;
+	bool resyncing;
+
+	/* Servers as of the last sync, kept across BYE and updated by resync */
+	bool has_shadow;
+	unsigned int shadow_count;
+	unsigned int shadow_size;
+	struct resync_entry *shadow;
+};
+
+struct service_index {
+	unsigned int service;
+
+	/* Sorted by instance */
+	struct server_array servers;
+
+	struct map_item mi;
+};
+
+static struct node *node_get(struct qrtr_ns *ctx, unsigned int node_id)
+{
+	struct map_item *mi;
+	struct node *node;
+	int rc;
+
+	mi = map_get(&ctx->nodes, hash_u32(node_id));
+	if (mi)
+		return container_of(mi, struct node, mi);
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	node->id = node_id;
+
+	rc = map_create(&node->services);
+	if (!rc)
+		rc = map_create(&node->clients);
+	if (rc)
+		LOGE_AND_EXIT("unable to create map");
+
+	rc = map_put(&ctx->nodes, hash_u32(node_id), &node->mi);
+	if (rc) {
+		map_destroy(&node->clients);
+		map_destroy(&node->services);
+		free(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+static void client_mi_free(struct map_item *mi)
+{
+	free(container_of(mi, struct client, mi));
+}
+
+static struct client *client_get(struct node *node, unsigned int port)
+{
+	struct client *client;
+	struct map_item *mi;
+
+	mi = map_get(&node->clients, hash_u32(port));
+	if (mi)
+		return container_of(mi, struct client, mi);
+
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		return NULL;
+
+	if (map_put(&node->clients, hash_u32(port), &client->mi)) {
+		free(client);
+		return NULL;
+	}
+
+	return client;
+}
+
+static void client_del(struct node *node, unsigned int port)
+{
+	struct map_item *mi;
+
+	mi = map_get(&node->clients, hash_u32(port));
+	if (!mi)
+		return;
+
+	map_remove(&node->clients, mi->key);
+	free(container_of(mi, struct client, mi));
+}
+
+static int filter_match(const struct server_filter *f, unsigned int service,
+			unsigned int instance)
+{
+	unsigned int ifilter = f->ifilter;
+
+	if (f->service != 0 && service != f->service)
+		return 0;
+	if (instance < f->imin || instance > f->imax)
+		return 0;
+	if (!ifilter && f->instance)
+		ifilter = ~0;
+	return (instance & ifilter) == f->instance;
+}
+
+static int server_match(const struct server *srv, const struct server_filter *f)
+{
+	return filter_match(f, srv->service, srv->instance);
+}
+
+static int server_array_grow(struct server_array *a)
+{
+	unsigned int size = a->size + 16;
+	uint32_t *service;
+	uint32_t *instance;
+	struct server **srvs;
+
+	service = realloc(a->service, size * sizeof(*service));
+	if (!service)
+		return -ENOMEM;
+	a->service = service;
+
+	instance = realloc(a->instance, size * sizeof(*instance));
+	if (!instance)
+		return -ENOMEM;
+	a->instance = instance;
+
+	srvs = realloc(a->srvs, size * sizeof(*srvs));
+	if (!srvs)
+		return -ENOMEM;
+	a->srvs = srvs;
+
+	a->size = size;
+
+	return 0;
+}
+
+static int server_array_insert(struct server_array *a, unsigned int pos,
+			       struct server *srv)
+{
+	unsigned int n = a->count - pos;
+	int rc;
+
+	if (a->count == a->size) {
+		rc = server_array_grow(a);
+		if (rc)
+			return rc;
+	}
+
+	memmove(&a->service[pos + 1], &a->service[pos], n * sizeof(*a->service));
+	memmove(&a->instance[pos + 1], &a->instance[pos], n * sizeof(*a->instance));
+	memmove(&a->srvs[pos + 1], &a->srvs[pos], n * sizeof(*a->srvs));
+
+	a->service[pos] = srv->service;
+	a->instance[pos] = srv->instance;
+	a->srvs[pos] = srv;
+	a->count++;
+
+	return 0;
+}
+
+static void server_array_remove(struct server_array *a, unsigned int pos)
+{
+	unsigned int n = --a->count - pos;
+
+	memmove(&a->service[pos], &a->service[pos + 1], n * sizeof(*a->service));
+	memmove(&a->instance[pos], &a->instance[pos + 1], n * sizeof(*a->instance));
+	memmove(&a->srvs[pos], &a->srvs[pos + 1], n * sizeof(*a->srvs));
+}
+
+static void server_array_free(struct server_array *a)
+{
+	free(a->service);
+	free(a->instance);
+	free(a->srvs);
+}
+
+/* Index of the first server with an instance not below @instance, if sorted */
+static unsigned int server_array_lower(const struct server_array *a,
+				       unsigned int instance)
+{
+	unsigned int lo = 0;
+	unsigned int hi = a->count;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (a->instance[mid] < instance)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef int32_t s32x4 __attribute__((vector_size(16)));
+
+/*
+ * Stores the indices of the servers in [@start, @end) of @a matching @f in
+ * @idx, comparing four servers at a time, and returns their number.
+ */
+static unsigned int server_array_match(const struct server_array *a,
+				       unsigned int start, unsigned int end,
+				       const struct server_filter *f,
+				       unsigned int *idx)
+{
+	unsigned int ifilter = f->ifilter;
+	u32x4 vservice, vinstance, vmask, vmin, vmax;
+	u32x4 service, instance;
+	s32x4 any_service;
+	s32x4 m;
+	unsigned int n = 0;
+	unsigned int i = start;
+	unsigned int j;
+
+	if (!ifilter && f->instance)
+		ifilter = ~0;
+
+	vservice = (u32x4){ f->service, f->service, f->service, f->service };
+	vinstance = (u32x4){ f->instance, f->instance, f->instance, f->instance };
+	vmask = (u32x4){ ifilter, ifilter, ifilter, ifilter };
+	vmin = (u32x4){ f->imin, f->imin, f->imin, f->imin };
+	vmax = (u32x4){ f->imax, f->imax, f->imax, f->imax };
+	any_service = vservice == 0;
+
+	for (; i + 4 <= end; i += 4) {
+		memcpy(&service, &a->service[i], sizeof(service));
+		memcpy(&instance, &a->instance[i], sizeof(instance));
+
+		m = any_service | (service == vservice);
+		m &= (instance & vmask) == vinstance;
+		m &= instance >= vmin;
+		m &= instance <= vmax;
+
+		if (!(m[0] | m[1] | m[2] | m[3]))
+			continue;
+
+		for (j = 0; j < 4; j++) {
+			if (m[j])
+				idx[n++] = i + j;
+		}
+	}
+
+	for (; i < end; i++) {
+		if (filter_match(f, a->service[i], a->instance[i]))
+			idx[n++] = i;
+	}
+
+	return n;
+}
+
+static struct service_index *service_index_get(struct qrtr_ns *ctx,
+					       unsigned int service)
+{
+	struct map_item *mi;
+
+	mi = map_get(&ctx->services, hash_u32(service));
+	if (!mi)
+		return NULL;
+
+	return container_of(mi, struct service_index, mi);
+}
+
+static int service_index_add(struct qrtr_ns *ctx, struct server *srv)
+{
+	struct service_index *idx;
+	unsigned int pos;
+	int rc;
+
+	idx = service_index_get(ctx, srv->service);
+	if (!idx) {
+		idx = calloc(1, sizeof(*idx));
+		if (!idx)
+			return -ENOMEM;
+
+		idx->service = srv->service;
+
+		rc = map_put(&ctx->services, hash_u32(srv->service), &idx->mi);
+		if (rc) {
+			free(idx);
+			return rc;
+		}
+	}
+
+	pos = server_array_lower(&idx->servers, srv->instance);
+
+	return server_array_insert(&idx->servers, pos, srv);
+}
+
+static void service_index_del(struct qrtr_ns *ctx, struct server *srv)
+{
+	struct service_index *idx;
+	unsigned int pos;
+
+	idx = service_index_get(ctx, srv->service);
+	if (!idx)
+		return;
+
+	pos = server_array_lower(&idx->servers, srv->instance);
+	for (; pos < idx->servers.count; pos++) {
+		if (idx->servers.srvs[pos] == srv)
+			break;
+	}
+	if (pos == idx->servers.count)
+		return;
+
+	server_array_remove(&idx->servers, pos);
+
+	if (!idx->servers.count) {
+		map_remove(&ctx->services, idx->mi.key);
+		server_array_free(&idx->servers);
+		free(idx);
+	}
+}
+
+static int node_servers_add(struct node *node, struct server *srv)
+{
+	srv->slot = node->servers.count;
+
+	return server_array_insert(&node->servers, srv->slot, srv);
+}
+
+/* Fills the hole with the last server, the order doesn't matter */
+static void node_servers_del(struct node *node, struct server *srv)
+{
+	struct server_array *a = &node->servers;
+	unsigned int last = a->count - 1;
+	struct server *moved;
+
+	if (srv->slot != last) {
+		moved = a->srvs[last];
+		moved->slot = srv->slot;
+
+		a->service[srv->slot] = moved->service;
+		a->instance[srv->slot] = moved->instance;
+		a->srvs[srv->slot] = moved;
+	}
+
+	a->count--;
+}
+
+/*
+ * Narrows the range of instances a sorted array has to be searched in for
+ * @f, returns false if nothing can match.
+ */
+static bool filter_range(const struct server_filter *f, unsigned int *lo,
+			 unsigned int *hi)
+{
+	unsigned int ifilter = f->ifilter;
+
+	*lo = f->imin;
+	*hi = f->imax;
+
+	if (!ifilter && f->instance)
+		ifilter = ~0;
+
+	/* A mask of contiguous high bits selects a range of instances */
+	if (ifilter && !(~ifilter & (~ifilter + 1))) {
+		if (f->instance & ~ifilter)
+			return false;
+		if (f->instance > *lo)
+			*lo = f->instance;
+		if ((f->instance | ~ifilter) < *hi)
+			*hi = f->instance | ~ifilter;
+	}
+
+	return *lo <= *hi;
+}
+
+/*
+ * Returns the number of servers matching @f, stored in a newly allocated
+ * array in @result, or negative errno. A service index only has the range
+ * of instances which may match searched, otherwise the servers of every
+ * node are.
+ */
+static int server_query(struct qrtr_ns *ctx, const struct server_filter *f,
+			struct server ***result)
+{
+	const struct server_array *a = NULL;
+	struct service_index *sidx;
+	struct map_entry *node_me;
+	struct server **srvs;
+	struct node *node;
+	unsigned int start = 0;
+	unsigned int end = 0;
+	unsigned int total;
+	unsigned int *idx;
+	unsigned int lo;
+	unsigned int hi;
+	unsigned int n;
+	unsigned int i;
+	int count = 0;
+
+	*result = NULL;
+
+	if (f->service) {
+		sidx = service_index_get(ctx, f->service);
+		if (!sidx || !filter_range(f, &lo, &hi))
+			return 0;
+
+		a = &sidx->servers;
+		start = server_array_lower(a, lo);
+		end = hi == UINT_MAX ? a->count : server_array_lower(a, hi + 1);
+		total = end - start;
+	} else {
+		total = 0;
+		map_for_each(&ctx->nodes, node_me) {
+			node = map_iter_data(node_me, struct node, mi);
+			total += node->servers.count;
+		}
+	}
+
+	if (!total)
+		return 0;
+
+	srvs = malloc(total * sizeof(*srvs));
+	idx = malloc(total * sizeof(*idx));
+	if (!srvs || !idx) {
+		free(srvs);
+		free(idx);
+		return -ENOMEM;
+	}
+
+	if (a) {
+		n = server_array_match(a, start, end, f, idx);
+		for (i = 0; i < n; i++)
+			srvs[count++] = a->srvs[idx[i]];
+	} else {
+		map_for_each(&ctx->nodes, node_me) {
+			node = map_iter_data(node_me, struct node, mi);
+			a = &node->servers;
+
+			n = server_array_match(a, 0, a->count, f, idx);
+			for (i = 0; i < n; i++)
+				srvs[count++] = a->srvs[idx[i]];
+		}
+	}
+
+	free(idx);
+
+	*result = srvs;
+	return count;
+}
+
+static int ns_send(struct qrtr_ns *ctx, const struct sockaddr_qrtr *to,
+		   const void *buf, size_t len)
+{
+	const struct qrtr_ctrl_pkt *pkt = buf;
+	int rc;
+
+	rc = ctx->ops->send(ctx->data, to, buf, len);
+	QRTR_PROBE(ns_send, to->sq_node, to->sq_port, le32_to_cpu(pkt->cmd), rc);
+
+	return rc;
+}
+
+static void ns_resume(struct qrtr_ns *ctx, unsigned int node,
+		      unsigned int port)
+{
+	if (ctx->ops->resume)
+		ctx->ops->resume(ctx->data, node, port);
+}
+
+static void ns_drop(struct qrtr_ns *ctx, unsigned int node, unsigned int port)
+{
+	if (ctx->ops->drop)
+		ctx->ops->drop(ctx->data, node, port);
+}
+
+static int service_announce_new(struct qrtr_ns *ctx,
+				struct sockaddr_qrtr *dest,
+				struct server *srv)
+{
+	struct qrtr_ctrl_pkt cmsg;
+	int rc;
+
+	LOGD("advertising new server [%u:%x]@[%u:%u]\n",
+		srv->service, srv->instance, srv->node, srv->port);
+
+	cmsg.cmd = cpu_to_le32(QRTR_TYPE_NEW_SERVER);
+	cmsg.server.service = cpu_to_le32(srv->service);
+	cmsg.server.instance = cpu_to_le32(srv->instance);
+	cmsg.server.node = cpu_to_le32(srv->node);
+	cmsg.server.port = cpu_to_le32(srv->port);
+
+	rc = ns_send(ctx, dest, &cmsg, sizeof(cmsg));
+	if (rc < 0)
+		PLOGW("sendto()");
+
+	return rc;
+}
+
+static int service_announce_del(struct qrtr_ns *ctx,
+				struct sockaddr_qrtr *dest,
+				struct server *srv)
+{
+	struct qrtr_ctrl_pkt cmsg;
+	int rc;
+
+	LOGD("advertising removal of server [%u:%x]@[%u:%u]\n",
+		srv->service, srv->instance, srv->node, srv->port);
+
+	cmsg.cmd = cpu_to_le32(QRTR_TYPE_DEL_SERVER);
+	cmsg.server.service = cpu_to_le32(srv->service);
+	cmsg.server.instance = cpu_to_le32(srv->instance);
+	cmsg.server.node = cpu_to_le32(srv->node);
+	cmsg.server.port = cpu_to_le32(srv->port);
+
+	rc = ns_send(ctx, dest, &cmsg, sizeof(cmsg));
+	if (rc < 0)
+		PLOGW("sendto()");
+
+	return rc;
+}
+
+static int lookup_notify(struct qrtr_ns *ctx, struct sockaddr_qrtr *to,
+			 struct server *srv, bool new)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+	int rc;
+
+	pkt.cmd = new ? QRTR_TYPE_NEW_SERVER : QRTR_TYPE_DEL_SERVER;
+	if (srv) {
+		pkt.server.service = cpu_to_le32(srv->service);
+		pkt.server.instance = cpu_to_le32(srv->instance);
+		pkt.server.node = cpu_to_le32(srv->node);
+		pkt.server.port = cpu_to_le32(srv->port);
+	}
+
+	rc = ns_send(ctx, to, &pkt, sizeof(pkt));
+	if (rc < 0)
+		PLOGW("send lookup result failed");
+	return rc;
+}
+
+static int annouce_servers(struct qrtr_ns *ctx, struct sockaddr_qrtr *sq)
+{
+	struct map_entry *me;
+	struct server *srv;
+	struct node *node;
+	int rc;
+
+	node = node_get(ctx, ctx->local_node);
+	if (!node)
+		return 0;
+
+	map_for_each(&node->services, me) {
+		srv = map_iter_data(me, struct server, mi);
+
+		rc = service_announce_new(ctx, sq, srv);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+static void registry_changed(struct qrtr_ns *ctx, unsigned int service)
+{
+	ctx->gen++;
+	ctx->service_gen[service % SERVICE_GEN_BUCKETS]++;
+	ctx->dirty = true;
+}
+
+static struct server *server_add(struct qrtr_ns *ctx,
+	unsigned int service, unsigned int instance,
+	unsigned int node_id, unsigned int port)
+{
+	struct map_item *mi;
+	struct server *srv;
+	struct node *node;
+	int rc;
+
+	if (!service || !port)
+		return NULL;
+
+	srv = calloc(1, sizeof(*srv));
+	if (srv == NULL)
+		return NULL;
+
+	srv->service = service;
+	srv->instance = instance;
+	srv->node = node_id;
+	srv->port = port;
+
+	node = node_get(ctx, node_id);
+	if (!node)
+		goto err;
+
+	rc = node_servers_add(node, srv);
+	if (rc)
+		goto err;
+
+	rc = service_index_add(ctx, srv);
+	if (rc) {
+		node_servers_del(node, srv);
+		goto err;
+	}
+
+	rc = map_reput(&node->services, hash_u32(port), &srv->mi, &mi);
+	if (rc) {
+		service_index_del(ctx, srv);
+		node_servers_del(node, srv);
+		goto err;
+	}
+
+	LOGD("add server [%u:%x]@[%u:%u]\n", srv->service, srv->instance,
+		srv->node, srv->port);
+
+	if (mi) { /* we replaced someone */
+		struct server *old = container_of(mi, struct server, mi);
+		node_servers_del(node, old);
+		service_index_del(ctx, old);
+		registry_changed(ctx, old->service);
+		free(old);
+	}
+
+	registry_changed(ctx, service);
+
+	if (ctx->resync && node_id == ctx->local_node)
+		resync_log_add(&ctx->rlog, service, instance, port);
+
+	return srv;
+
+err:
+	free(srv);
+	return NULL;
+}
+
+static int server_del(struct qrtr_ns *ctx, struct node *node, unsigned int port)
+{
+	struct lookup *lookup;
+	struct list_item *li;
+	struct map_item *mi;
+	struct server *srv;
+
+	mi = map_get(&node->services, hash_u32(port));
+	if (!mi)
+		return -ENOENT;
+
+	srv = container_of(mi, struct server, mi);
+	map_remove(&node->services, srv->mi.key);
+	node_servers_del(node, srv);
+	service_index_del(ctx, srv);
+	registry_changed(ctx, srv->service);
+
+	if (ctx->resync && srv->node == ctx->local_node)
+		resync_log_add(&ctx->rlog, 0, 0, port);
+
+	/* Broadcast the removal of local services */
+	if (srv->node == ctx->local_node)
+		service_announce_del(ctx, &ctx->bcast_sq, srv);
+
+	/* Announce the service's disappearance to observers */
+	list_for_each(&ctx->lookups, li) {
+		lookup = container_of(li, struct lookup, li);
+		if (!server_match(srv, &lookup->filter))
+			continue;
+
+		lookup_notify(ctx, &lookup->sq, srv, false);
+	}
+
+	free(srv);
+
+	return 0;
+}
+
+static struct resync_entry *shadow_find(struct node *node, unsigned int port)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->shadow_count; i++) {
+		if (node->shadow[i].port == port)
+			return &node->shadow[i];
+	}
+
+	return NULL;
+}
+
+static int shadow_set(struct node *node, unsigned int service,
+		      unsigned int instance, unsigned int port)
+{
+	struct resync_entry *entry;
+	unsigned int size;
+
+	entry = shadow_find(node, port);
+	if (!entry) {
+		if (node->shadow_count == node->shadow_size) {
+			size = node->shadow_size ? node->shadow_size * 2 : 16;
+			entry = realloc(node->shadow, size * sizeof(*entry));
+			if (!entry)
+				return -ENOMEM;
+
+			node->shadow = entry;
+			node->shadow_size = size;
+		}
+
+		entry = &node->shadow[node->shadow_count++];
+		entry->port = port;
+	}
+
+	entry->service = service;
+	entry->instance = instance;
+
+	return 0;
+}
+
+static void shadow_del(struct node *node, unsigned int port)
+{
+	struct resync_entry *entry;
+
+	entry = shadow_find(node, port);
+	if (entry)
+		*entry = node->shadow[--node->shadow_count];
+}
+
+static void shadow_free(struct node *node)
+{
+	free(node->shadow);
+	node->shadow = NULL;
+	node->shadow_count = 0;
+	node->shadow_size = 0;
+	node->has_shadow = false;
+}
+
+/* Start the shadow off the servers registered for @node */
+static int shadow_snapshot(struct node *node)
+{
+	struct server *srv;
+	unsigned int i;
+
+	node->shadow_count = 0;
+	node->has_shadow = true;
+
+	for (i = 0; i < node->servers.count; i++) {
+		srv = node->servers.srvs[i];
+		if (shadow_set(node, srv->service, srv->instance, srv->port) < 0) {
+			shadow_free(node);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int resync_hello(struct qrtr_ns *ctx, struct sockaddr_qrtr *to,
+			unsigned int flags);
+static int resync_request(struct qrtr_ns *ctx, unsigned int node_id,
+			  unsigned int epoch, unsigned int gen);
+
+static int ctrl_cmd_hello(struct qrtr_ns *ctx, struct sockaddr_qrtr *sq,
+			  const void *buf, size_t len)
+{
+	const struct qrtr_ctrl_hello_ext *ext = buf;
+	unsigned int flags;
+	int rc = 0;
+
+	/*
+	 * A peer doing incremental resync gets our generation instead of all
+	 * servers, a legacy one echoing our own HELLO is treated classically.
+	 * Replies aren't answered, or two name services would bounce HELLOs
+	 * back and forth.
+	 */
+	if (ctx->resync && sq->sq_node != ctx->local_node &&
+	    len >= sizeof(*ext) &&
+	    (le32_to_cpu(ext->flags) & QRTR_HELLO_F_RESYNC) &&
+	    le32_to_cpu(ext->epoch) != ctx->rlog.epoch) {
+		flags = le32_to_cpu(ext->flags);
+		if (!(flags & QRTR_HELLO_F_REPLY))
+			rc = resync_hello(ctx, sq, QRTR_HELLO_F_REPLY);
+		if (rc >= 0)
+			rc = resync_request(ctx, sq->sq_node,
+					    le32_to_cpu(ext->epoch),
+					    le32_to_cpu(ext->gen));
+		return rc;
+	}
+
+	rc = ns_send(ctx, sq, buf, len);
+	if (rc > 0)
+		rc = annouce_servers(ctx, sq);
+
+	return rc;
+}
+
+static int ctrl_cmd_bye(struct qrtr_ns *ctx, struct sockaddr_qrtr *from)
+{
+	struct qrtr_ctrl_pkt pkt;
+	struct sockaddr_qrtr sq;
+	struct node *local_node;
+	struct map_entry *me;
+	struct server *srv;
+	struct node *node;
+	int rc;
+
+	ns_drop(ctx, from->sq_node, 0);
+
+	node = node_get(ctx, from->sq_node);
+	if (!node)
+		return 0;
+
+	map_clear(&node->clients, client_mi_free);
+
+	/*
+	 * Remember the servers of a node we resync with, so that only the
+	 * changes are needed once it's back. An interrupted resync starts over.
+	 */
+	if (node->resyncing) {
+		node->resyncing = false;
+		node->epoch = 0;
+		shadow_free(node);
+	} else if (node->epoch && !node->has_shadow) {
+		if (shadow_snapshot(node) < 0)
+			node->epoch = 0;
+	}
+
+	map_for_each(&node->services, me) {
+		srv = map_iter_data(me, struct server, mi);
+
+		server_del(ctx, node, srv->port);
+	}
+
+	/* Advertise the removal of this client to all local services */
+	local_node = node_get(ctx, ctx->local_node);
+	if (!local_node)
+		return 0;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.cmd = QRTR_TYPE_BYE;
+	pkt.client.node = from->sq_node;
+
+	map_for_each(&local_node->services, me) {
+		srv = map_iter_data(me, struct server, mi);
+
+		sq.sq_family = AF_QIPCRTR;
+		sq.sq_node = srv->node;
+		sq.sq_port = srv->port;
+
+		rc = ns_send(ctx, &sq, &pkt, sizeof(pkt));
+		if (rc < 0)
+			PLOGW("bye propagation failed");
+	}
+
+	return 0;
+}
+
+static int ctrl_cmd_del_client(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+			       unsigned node_id, unsigned port)
+{
+	struct qrtr_ctrl_pkt pkt;
+	struct sockaddr_qrtr sq;
+	struct node *local_node;
+	struct list_item *tmp;
+	struct lookup *lookup;
+	struct list_item *li;
+	struct map_entry *me;
+	struct server *srv;
+	struct node *node;
+	int rc;
+
+	/* Don't accept spoofed messages */
+	if (from->sq_node != node_id)
+		return -EINVAL;
+
+	/* Local DEL_CLIENT messages comes from the port being closed */
+	if (from->sq_node == ctx->local_node && from->sq_port != port)
+		return -EINVAL;
+
+	ns_drop(ctx, node_id, port);
+
+	/* Remove any lookups by this client */
+	list_for_each_safe(&ctx->lookups, li, tmp) {
+		lookup = container_of(li, struct lookup, li);
+		if (lookup->sq.sq_node != node_id)
+			continue;
+		if (lookup->sq.sq_port != port)
+			continue;
+
+		list_remove(&ctx->lookups, &lookup->li);
+		free(lookup);
+		ctx->dirty = true;
+	}
+
+	/* Remove the server belonging to this port*/
+	node = node_get(ctx, node_id);
+	if (node) {
+		server_del(ctx, node, port);
+		client_del(node, port);
+	}
+
+	/* Advertise the removal of this client to all local services */
+	local_node = node_get(ctx, ctx->local_node);
+	if (!local_node)
+		return 0;
+
+	pkt.cmd = QRTR_TYPE_DEL_CLIENT;
+	pkt.client.node = node_id;
+	pkt.client.port = port;
+
+	map_for_each(&local_node->services, me) {
+		srv = map_iter_data(me, struct server, mi);
+
+		sq.sq_family = AF_QIPCRTR;
+		sq.sq_node = srv->node;
+		sq.sq_port = srv->port;
+
+		rc = ns_send(ctx, &sq, &pkt, sizeof(pkt));
+		if (rc < 0)
+			PLOGW("del_client propagation failed");
+	}
+
+	return 0;
+}
+
+static int ctrl_cmd_new_server(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+			       unsigned int service, unsigned int instance,
+			       unsigned int node_id, unsigned int port)
+{
+	struct lookup *lookup;
+	struct list_item *li;
+	struct server *srv;
+	int rc = 0;
+
+	/* Ignore specified node and port for local servers*/
+	if (from->sq_node == ctx->local_node) {
+		node_id = from->sq_node;
+		port = from->sq_port;
+	}
+
+	/* Don't accept spoofed messages */
+	if (from->sq_node != node_id)
+		return -EINVAL;
+
+	srv = server_add(ctx, service, instance, node_id, port);
+	if (!srv)
+		return -EINVAL;
+
+	if (srv->node == ctx->local_node)
+		rc = service_announce_new(ctx, &ctx->bcast_sq, srv);
+
+	list_for_each(&ctx->lookups, li) {
+		lookup = container_of(li, struct lookup, li);
+		if (!server_match(srv, &lookup->filter))
+			continue;
+
+		lookup_notify(ctx, &lookup->sq, srv, true);
+	}
+
+	return rc;
+}
+
+static int ctrl_cmd_del_server(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+			       unsigned int service, unsigned int instance,
+			       unsigned int node_id, unsigned int port)
+{
+	struct node *node;
+
+	/* Ignore specified node and port for local servers*/
+	if (from->sq_node == ctx->local_node) {
+		node_id = from->sq_node;
+		port = from->sq_port;
+	}
+
+	/* Don't accept spoofed messages */
+	if (from->sq_node != node_id)
+		return -EINVAL;
+
+	/* Local servers may only unregister themselves */
+	if (from->sq_node == ctx->local_node && from->sq_port != port)
+		return -EINVAL;
+
+	node = node_get(ctx, node_id);
+	if (!node)
+		return -ENOENT;
+
+	return server_del(ctx, node, port);
+}
+
+/* Generation to validate cached results of @f against */
+static unsigned int lookup_cache_gen(struct qrtr_ns *ctx,
+				     const struct server_filter *f)
+{
+	if (!f->service)
+		return ctx->gen;
+
+	return ctx->service_gen[f->service % SERVICE_GEN_BUCKETS];
+}
+
+/*
+ * Returns the servers matching @f, in wire format, from the cache if they're
+ * still valid, otherwise from a fresh query replacing the least recently
+ * used entry.
+ */
+static const struct qrtr_server_rec *lookup_cache_get(struct qrtr_ns *ctx,
+						       const struct server_filter *f,
+						       unsigned int *count)
+{
+	struct lookup_cache_entry *victim = NULL;
+	struct lookup_cache_entry *entry;
+	struct qrtr_server_rec *recs;
+	struct server **srvs;
+	unsigned int gen;
+	struct server *srv;
+	unsigned int i;
+	int n;
+
+	gen = lookup_cache_gen(ctx, f);
+
+	for (i = 0; i < LOOKUP_CACHE_SIZE; i++) {
+		entry = &ctx->lookup_cache[i];
+
+		if (entry->recs && entry->gen == gen &&
+		    !memcmp(&entry->filter, f, sizeof(*f))) {
+			entry->last_used = ++ctx->lookup_tick;
+			*count = entry->count;
+			return entry->recs;
+		}
+
+		if (!victim || entry->last_used < victim->last_used)
+			victim = entry;
+	}
+
+	n = server_query(ctx, f, &srvs);
+	if (n < 0)
+		return NULL;
+
+	recs = malloc((n ? n : 1) * sizeof(*recs));
+	if (!recs) {
+		free(srvs);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		srv = srvs[i];
+
+		recs[i].service = cpu_to_le32(srv->service);
+		recs[i].instance = cpu_to_le32(srv->instance);
+		recs[i].node = cpu_to_le32(srv->node);
+		recs[i].port = cpu_to_le32(srv->port);
+	}
+
+	free(srvs);
+
+	free(victim->recs);
+	victim->filter = *f;
+	victim->gen = gen;
+	victim->last_used = ++ctx->lookup_tick;
+	victim->count = n;
+	victim->recs = recs;
+
+	*count = n;
+	return recs;
+}
+
+static void lookup_cache_clear(struct qrtr_ns *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < LOOKUP_CACHE_SIZE; i++) {
+		free(ctx->lookup_cache[i].recs);
+		ctx->lookup_cache[i].recs = NULL;
+	}
+}
+
+/* Reply with as many servers per message as fit, for capable clients */
+static int ns_send_packed(struct qrtr_ns *ctx, struct sockaddr_qrtr *to,
+			  unsigned int cmd, const struct qrtr_server_rec *recs,
+			  unsigned int count)
+{
+	uint32_t buf[QRTR_PACKED_MAX_SIZE / sizeof(uint32_t)];
+	struct qrtr_ctrl_packed *pkt = (void *)buf;
+	unsigned int n;
+	int rc;
+
+	pkt->cmd = cpu_to_le32(cmd);
+
+	while (count) {
+		n = count < QRTR_PACKED_MAX_RECS ? count : QRTR_PACKED_MAX_RECS;
+
+		pkt->count = cpu_to_le32(n);
+		memcpy(pkt->recs, recs, n * sizeof(*recs));
+
+		rc = ns_send(ctx, to, pkt, sizeof(*pkt) + n * sizeof(*recs));
+		if (rc < 0) {
+			PLOGW("send packed records failed");
+			return rc;
+		}
+
+		recs += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+static int lookup_reply(struct qrtr_ns *ctx, struct sockaddr_qrtr *to,
+			const struct qrtr_server_rec *recs, unsigned int count)
+{
+	struct qrtr_ctrl_pkt pkt = {};
+	unsigned int i;
+	int rc;
+
+	pkt.cmd = cpu_to_le32(QRTR_TYPE_NEW_SERVER);
+
+	for (i = 0; i < count; i++) {
+		pkt.server.service = recs[i].service;
+		pkt.server.instance = recs[i].instance;
+		pkt.server.node = recs[i].node;
+		pkt.server.port = recs[i].port;
+
+		rc = ns_send(ctx, to, &pkt, sizeof(pkt));
+		if (rc < 0) {
+			PLOGW("send lookup result failed");
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Extract the filter of a NEW_LOOKUP or DEL_LOOKUP, honoring the instance
+ * mask and range when the lookup carries them. A zero instance of a classic
+ * lookup is a wildcard.
+ */
+static void lookup_filter_parse(struct server_filter *f, const void *buf,
+				size_t len, unsigned int *flags)
+{
+	const struct qrtr_ctrl_lookup_ext *ext = buf;
+
+	memset(f, 0, sizeof(*f));
+	f->service = le32_to_cpu(ext->pkt.server.service);
+	f->instance = le32_to_cpu(ext->pkt.server.instance);
+	f->imax = ~0;
+
+	*flags = le32_to_cpu(ext->pkt.server.port);
+	if (!(*flags & QRTR_LOOKUP_F_RANGE))
+		return;
+
+	if (len < sizeof(*ext)) {
+		*flags &= ~QRTR_LOOKUP_F_RANGE;
+		return;
+	}
+
+	f->instance = le32_to_cpu(ext->instance);
+	f->ifilter = le32_to_cpu(ext->ifilter);
+	f->imin = le32_to_cpu(ext->imin);
+	f->imax = le32_to_cpu(ext->imax);
+}
+
+static int ctrl_cmd_new_lookup(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+			       const struct server_filter *filter,
+			       unsigned int flags)
+{
+	const struct qrtr_server_rec *recs;
+	struct lookup *lookup;
+	unsigned int count;
+
+	/* Accept only local observers */
+	if (from->sq_node != ctx->local_node)
+		return -EINVAL;
+
+	lookup = calloc(1, sizeof(*lookup));
+	if (!lookup)
+		goto err_terminate;
+
+	lookup->sq = *from;
+	lookup->filter = *filter;
+	list_append(&ctx->lookups, &lookup->li);
+
+	recs = lookup_cache_get(ctx, filter, &count);
+	if (!recs)
+		goto err_free_lookup;
+
+	ctx->dirty = true;
+
+	if (flags & QRTR_LOOKUP_F_PACKED)
+		ns_send_packed(ctx, from, QRTR_TYPE_NEW_SERVER_PACKED, recs,
+			       count);
+	else
+		lookup_reply(ctx, from, recs, count);
+
+	/* Terminated by an empty classic reply, in both cases */
+	lookup_notify(ctx, from, NULL, true);
+
+	return 0;
+
+err_free_lookup:
+	list_remove(&ctx->lookups, &lookup->li);
+	free(lookup);
+err_terminate:
+	/* Never leave the client waiting for a terminator that won't come */
+	lookup_notify(ctx, from, NULL, true);
+
+	return -ENOMEM;
+}
+
+static int ctrl_cmd_del_lookup(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+			       const struct server_filter *filter,
+			       unsigned int flags)
+{
+	struct lookup *lookup;
+	struct list_item *tmp;
+	struct list_item *li;
+
+	list_for_each_safe(&ctx->lookups, li, tmp) {
+		lookup = container_of(li, struct lookup, li);
+		if (lookup->sq.sq_node != from->sq_node)
+			continue;
+		if (lookup->sq.sq_port != from->sq_port)
+			continue;
+		if (lookup->filter.service != filter->service)
+			continue;
+		if (flags & QRTR_LOOKUP_F_RANGE) {
+			if (memcmp(&lookup->filter, filter, sizeof(*filter)))
+				continue;
+		} else if (lookup->filter.instance &&
+			   lookup->filter.instance != filter->instance) {
+			continue;
+		}
+
+		list_remove(&ctx->lookups, &lookup->li);
+		free(lookup);
+		ctx->dirty = true;
+	}
+
+	return 0;
+}
+
+static int resync_hello(struct qrtr_ns *ctx, struct sockaddr_qrtr *to,
+			unsigned int flags)
+{
+	struct qrtr_ctrl_hello_ext ext = {};
+
+	ext.pkt.cmd = cpu_to_le32(QRTR_TYPE_HELLO);
+	ext.flags = cpu_to_le32(QRTR_HELLO_F_RESYNC | flags);
+	ext.epoch = cpu_to_le32(ctx->rlog.epoch);
+	ext.gen = cpu_to_le32(ctx->rlog.gen);
+
+	return ns_send(ctx, to, &ext, sizeof(ext));
+}
+
+static int resync_send(struct qrtr_ns *ctx, struct sockaddr_qrtr *to,
+		       unsigned int cmd, unsigned int flags)
+{
+	struct qrtr_ctrl_resync pkt;
+
+	pkt.cmd = cpu_to_le32(cmd);
+	pkt.epoch = cpu_to_le32(ctx->rlog.epoch);
+	pkt.gen = cpu_to_le32(ctx->rlog.gen);
+	pkt.flags = cpu_to_le32(flags);
+
+	return ns_send(ctx, to, &pkt, sizeof(pkt));
+}
+
+/*
+ * Ask the name service of @node_id for what changed since we last synced,
+ * unless it's at @epoch and @gen already, as announced in its HELLO
+ */
+static int resync_request(struct qrtr_ns *ctx, unsigned int node_id,
+			  unsigned int epoch, unsigned int gen)
+{
+	struct qrtr_ctrl_resync pkt;
+	struct sockaddr_qrtr sq;
+	struct node *node;
+
+	node = node_get(ctx, node_id);
+	if (!node)
+		return -ENOMEM;
+
+	if (node->resyncing)
+		return 0;
+
+	/* A shadow means the servers were dropped when the node left */
+	if (node->epoch && node->epoch == epoch && node->gen == gen &&
+	    !node->has_shadow)
+		return 0;
+
+	/* Changes apply on top of what we know, when the node didn't leave */
+	if (!node->has_shadow && shadow_snapshot(node) < 0)
+		return -ENOMEM;
+
+	node->resyncing = true;
+
+	pkt.cmd = cpu_to_le32(QRTR_TYPE_RESYNC_REQ);
+	pkt.epoch = cpu_to_le32(node->epoch);
+	pkt.gen = cpu_to_le32(node->gen);
+	pkt.flags = 0;
+
+	sq.sq_family = AF_QIPCRTR;
+	sq.sq_node = node_id;
+	sq.sq_port = QRTR_PORT_CTRL;
+
+	return ns_send(ctx, &sq, &pkt, sizeof(pkt));
+}
+
+static void resync_rec(struct qrtr_server_rec *rec, unsigned int service,
+		       unsigned int instance, unsigned int node,
+		       unsigned int port)
+{
+	rec->service = cpu_to_le32(service);
+	rec->instance = cpu_to_le32(instance);
+	rec->node = cpu_to_le32(node);
+	rec->port = cpu_to_le32(port);
+}
+
+static bool resync_recs_have(const struct qrtr_server_rec *recs,
+			     unsigned int count, unsigned int port)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (le32_to_cpu(recs[i].port) == port)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Send the local servers changed since the generation the peer knows, only
+ * the last change of each port, or all servers if the change log doesn't
+ * reach back that far.
+ */
+static int ctrl_cmd_resync_req(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+			       const void *buf, size_t len)
+{
+	const struct qrtr_ctrl_resync *req = buf;
+	const struct resync_entry *entry;
+	struct qrtr_server_rec *recs;
+	unsigned int count = 0;
+	struct server *srv;
+	struct node *node;
+	unsigned int gen;
+	unsigned int max;
+	unsigned int i;
+	int changes;
+	int rc;
+
+	if (!ctx->resync)
+		return 0;
+
+	if (len < sizeof(*req) || from->sq_port != QRTR_PORT_CTRL ||
+	    from->sq_node == ctx->local_node)
+		return -EINVAL;
+
+	node = node_get(ctx, ctx->local_node);
+	if (!node)
+		return -ENOMEM;
+
+	gen = le32_to_cpu(req->gen);
+	changes = -1;
+	if (le32_to_cpu(req->epoch) == ctx->rlog.epoch)
+		changes = resync_log_since(&ctx->rlog, gen);
+
+	max = changes < 0 ? node->servers.count : changes;
+	recs = calloc(max ? max : 1, sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+
+	if (changes < 0) {
+		for (i = 0; i < node->servers.count; i++) {
+			srv = node->servers.srvs[i];
+			resync_rec(&recs[count++], srv->service, srv->instance,
+				   srv->node, srv->port);
+		}
+	} else {
+		for (i = ctx->rlog.gen; i != gen; i--) {
+			entry = resync_log_entry(&ctx->rlog, i);
+			if (resync_recs_have(recs, count, entry->port))
+				continue;
+
+			resync_rec(&recs[count++], entry->service,
+				   entry->instance, ctx->local_node,
+				   entry->port);
+		}
+	}
+
+	LOGD("resync %u:%u with %u changes%s\n", from->sq_node, ctx->rlog.gen,
+	     count, changes < 0 ? ", in full" : "");
+
+	rc = resync_send(ctx, from, QRTR_TYPE_RESYNC_ACK,
+			 changes < 0 ? QRTR_RESYNC_F_FULL : 0);
+	if (rc >= 0 && count)
+		rc = ns_send_packed(ctx, from, QRTR_TYPE_RESYNC_DATA, recs,
+				    count);
+	if (rc >= 0)
+		rc = resync_send(ctx, from, QRTR_TYPE_RESYNC_DONE, 0);
+
+	free(recs);
+
+	return rc < 0 ? rc : 0;
+}
+
+/* Find the node a resync reply is for, NULL when none was asked for */
+static struct node *resync_node(struct qrtr_ns *ctx,
+				struct sockaddr_qrtr *from, const void *buf,
+				size_t len, size_t min)
+{
+	struct node *node;
+
+	if (len < min || from->sq_port != QRTR_PORT_CTRL)
+		return NULL;
+
+	node = node_get(ctx, from->sq_node);
+	if (!node || !node->resyncing)
+		return NULL;
+
+	return node;
+}
+
+static int ctrl_cmd_resync_ack(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+			       const void *buf, size_t len)
+{
+	const struct qrtr_ctrl_resync *ack = buf;
+	struct node *node;
+
+	node = resync_node(ctx, from, buf, len, sizeof(*ack));
+	if (!node)
+		return 0;
+
+	/* All servers follow, forget what we had */
+	if (le32_to_cpu(ack->flags) & QRTR_RESYNC_F_FULL)
+		node->shadow_count = 0;
+
+	node->epoch = le32_to_cpu(ack->epoch);
+	node->gen = 0;
+
+	return 0;
+}
+
+static int ctrl_cmd_resync_data(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+				const void *buf, size_t len)
+{
+	const struct qrtr_ctrl_packed *pkt = buf;
+	const struct qrtr_server_rec *rec;
+	unsigned int count;
+	unsigned int i;
+	struct node *node;
+
+	node = resync_node(ctx, from, buf, len, sizeof(*pkt));
+	if (!node)
+		return 0;
+
+	count = le32_to_cpu(pkt->count);
+	if (count > (len - sizeof(*pkt)) / sizeof(*rec))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		rec = &pkt->recs[i];
+
+		/* Don't accept spoofed records */
+		if (le32_to_cpu(rec->node) != node->id)
+			continue;
+
+		if (!rec->service)
+			shadow_del(node, le32_to_cpu(rec->port));
+		else if (shadow_set(node, le32_to_cpu(rec->service),
+				    le32_to_cpu(rec->instance),
+				    le32_to_cpu(rec->port)) < 0)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Bring the registered servers of the node in line with the shadow, so that
+ * lookups only hear about servers which really came or went.
+ */
+static int ctrl_cmd_resync_done(struct qrtr_ns *ctx, struct sockaddr_qrtr *from,
+				const void *buf, size_t len)
+{
+	const struct qrtr_ctrl_resync *done = buf;
+	struct resync_entry *entry;
+	struct map_item *mi;
+	struct server *srv;
+	struct node *node;
+	unsigned int i;
+
+	node = resync_node(ctx, from, buf, len, sizeof(*done));
+	if (!node)
+		return 0;
+
+	for (i = node->servers.count; i-- > 0;) {
+		srv = node->servers.srvs[i];
+		if (!shadow_find(node, srv->port))
+			server_del(ctx, node, srv->port);
+	}
+
+	for (i = 0; i < node->shadow_count; i++) {
+		entry = &node->shadow[i];
+
+		mi = map_get(&node->services, hash_u32(entry->port));
+		if (mi) {
+			srv = container_of(mi, struct server, mi);
+			if (srv->service == entry->service &&
+			    srv->instance == entry->instance) {
+				srv->stale = false;
+				continue;
+			}
+		}
+
+		ctrl_cmd_new_server(ctx, from, entry->service, entry->instance,
+				    node->id, entry->port);
+	}
+
+	LOGD("resynced %u:%u with %u servers\n", node->id,
+	     le32_to_cpu(done->gen), node->shadow_count);
+
+	node->epoch = le32_to_cpu(done->epoch);
+	node->gen = le32_to_cpu(done->gen);
+	node->resyncing = false;
+	shadow_free(node);
+
+	return 0;
+}
+
+/*
+ * Take a token, or with @force take whatever is left, so that packets which
+ * can't be refused still count against the sender. A new bucket starts full.
+ */
+static bool bucket_take(struct token_bucket *tb, unsigned int rate,
+			unsigned int burst, uint64_t now, bool force)
+{
+	uint64_t max = (uint64_t)(burst ? burst : rate) * 1000;
+
+	tb->tokens += (now - tb->last) * rate;
+	if (tb->tokens > max)
+		tb->tokens = max;
+	tb->last = now;
+
+	if (tb->tokens >= 1000) {
+		tb->tokens -= 1000;
+		return true;
+	}
+
+	if (force) {
+		tb->tokens = 0;
+		return true;
+	}
+
+	return false;
+}
+
+/* Packets releasing resources, refusing them would only leak */
+static bool ns_admit_always(struct qrtr_ns *ctx,
+			    const struct sockaddr_qrtr *sq, unsigned int cmd)
+{
+	switch (cmd) {
+	case QRTR_TYPE_BYE:
+	case QRTR_TYPE_DEL_CLIENT:
+	case QRTR_TYPE_DEL_SERVER:
+	case QRTR_TYPE_DEL_LOOKUP:
+	case QRTR_TYPE_RESUME_TX:
+		return true;
+	case QRTR_TYPE_HELLO:
+	case QRTR_TYPE_NEW_SERVER:
+	case QRTR_TYPE_RESYNC_REQ:
+	case QRTR_TYPE_RESYNC_ACK:
+	case QRTR_TYPE_RESYNC_DATA:
+	case QRTR_TYPE_RESYNC_DONE:
+		/*
+		 * Registry events of another name service are never sent
+		 * again, refusing them would make the registries diverge
+		 */
+		return sq->sq_node != ctx->local_node &&
+		       sq->sq_port == QRTR_PORT_CTRL;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Enforce the limits before a packet is handled. Each port has a token
+ * bucket, each remote node another one covering all its ports; local
+ * clients aren't limited as a whole, so that one of them misbehaving can't
+ * starve the others. Then lookups per local client and servers per node
+ * are capped, replacing a server is always possible. Packets undoing state,
+ * and registry events of other name services, use up tokens but are never
+ * refused.
+ */
+static int ns_admit(struct qrtr_ns *ctx, const struct sockaddr_qrtr *sq,
+		    unsigned int cmd, const void *buf, size_t len)
+{
+	const struct qrtr_ns_limits *limits = &ctx->limits;
+	const struct qrtr_ctrl_pkt *msg = buf;
+	bool force = ns_admit_always(ctx, sq, cmd);
+	struct client *client;
+	struct lookup *lookup;
+	struct list_item *li;
+	struct node *node;
+	unsigned int count;
+	unsigned int port;
+	uint64_t now;
+
+	if (!limits->client_rate && !limits->node_rate &&
+	    !limits->max_lookups && !limits->max_servers)
+		return 0;
+
+	node = node_get(ctx, sq->sq_node);
+	if (!node)
+		return -ENOMEM;
+
+	now = time_ms();
+
+	if (limits->client_rate) {
+		client = client_get(node, sq->sq_port);
+		if (client && !bucket_take(&client->tb, limits->client_rate,
+					   limits->client_burst, now, force))
+			goto rate_limited;
+	}
+
+	if (limits->node_rate && sq->sq_node != ctx->local_node &&
+	    !bucket_take(&node->tb, limits->node_rate, limits->node_burst,
+			 now, force))
+		goto rate_limited;
+
+	if (cmd == QRTR_TYPE_NEW_LOOKUP && limits->max_lookups) {
+		count = 0;
+		list_for_each(&ctx->lookups, li) {
+			lookup = container_of(li, struct lookup, li);
+			if (lookup->sq.sq_node == sq->sq_node &&
+			    lookup->sq.sq_port == sq->sq_port)
+				count++;
+		}
+
+		if (count >= limits->max_lookups) {
+			ctx->stats.lookups_capped++;
+			LOGD("lookups of %u:%u capped\n", sq->sq_node,
+			     sq->sq_port);
+			return -ENOSPC;
+		}
+	}
+
+	if (cmd == QRTR_TYPE_NEW_SERVER && limits->max_servers &&
+	    len >= sizeof(*msg) && node->servers.count >= limits->max_servers) {
+		port = sq->sq_node == ctx->local_node ? sq->sq_port :
+			le32_to_cpu(msg->server.port);
+		if (!map_contains(&node->services, hash_u32(port))) {
+			ctx->stats.servers_capped++;
+			LOGD("servers of node %u capped\n", sq->sq_node);
+			return -ENOSPC;
+		}
+	}
+
+	return 0;
+
+rate_limited:
+	ctx->stats.rate_limited++;
+	LOGD("%u:%u rate limited\n", sq->sq_node, sq->sq_port);
+	return -EBUSY;
+}
+
+/* Records a packet handled in the trace ring, at the cost of a few stores */
+static void ns_trace_packet(struct qrtr_ns *ctx,
+			    const struct sockaddr_qrtr *from, unsigned int cmd,
+			    const void *buf, size_t len, int rc)
+{
+	const struct qrtr_ctrl_pkt *msg = buf;
+	struct ns_trace_entry *entry;
+
+	entry = ns_trace_next(&ctx->trace);
+	memset(entry, 0, sizeof(*entry));
+	entry->ts = time_ns();
+	entry->cmd = cmd;
+	entry->src_node = from->sq_node;
+	entry->src_port = from->sq_port;
+	entry->result = rc;
+
+	if (len >= sizeof(*msg)) {
+		switch (cmd) {
+		case QRTR_TYPE_NEW_SERVER:
+		case QRTR_TYPE_DEL_SERVER:
+			entry->node = le32_to_cpu(msg->server.node);
+			entry->port = le32_to_cpu(msg->server.port);
+			/* fall through */
+		case QRTR_TYPE_NEW_LOOKUP:
+		case QRTR_TYPE_DEL_LOOKUP:
+			entry->service = le32_to_cpu(msg->server.service);
+			entry->instance = le32_to_cpu(msg->server.instance);
+			break;
+		case QRTR_TYPE_BYE:
+		case QRTR_TYPE_DEL_CLIENT:
+		case QRTR_TYPE_RESUME_TX:
+			entry->node = le32_to_cpu(msg->client.node);
+			entry->port = le32_to_cpu(msg->client.port);
+			break;
+		}
+	}
+
+	ns_trace_commit(&ctx->trace);
+}
+
+static int ctrl_cmd_trace_req(struct qrtr_ns *ctx, struct sockaddr_qrtr *from)
+{
+	uint64_t buf[QRTR_PACKED_MAX_SIZE / sizeof(uint64_t)];
+	struct qrtr_ctrl_trace *pkt = (void *)buf;
+	struct qrtr_trace_rec *recs;
+	unsigned int count;
+	unsigned int i = 0;
+	unsigned int n;
+	int rc;
+
+	/* The trace tells about all clients, keep it on this machine */
+	if (from->sq_node != ctx->local_node)
+		return -EPERM;
+
+	recs = malloc(NS_TRACE_SIZE * sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+
+	count = ns_trace_snapshot(&ctx->trace, recs);
+
+	pkt->cmd = cpu_to_le32(QRTR_TYPE_TRACE_DATA);
+
+	/* Terminated by an empty TRACE_DATA */
+	do {
+		n = count - i;
+		if (n > QRTR_TRACE_MAX_RECS)
+			n = QRTR_TRACE_MAX_RECS;
+
+		pkt->count = cpu_to_le32(n);
+		memcpy(pkt->recs, recs + i, n * sizeof(*recs));
+
+		rc = ns_send(ctx, from, pkt, sizeof(*pkt) + n * sizeof(*recs));
+		if (rc < 0) {
+			PLOGW("send trace records failed");
+			break;
+		}
+
+		i += n;
+	} while (n);
+
+	free(recs);
+
+	return rc < 0 ? rc : 0;
+}
+
+/**
+ * qrtr_ns_process_packet() - Handle a control message
+ * @ctx:	Name service
+ * @from:	Sender of the message
+ * @buf:	Message
+ * @len:	Length of @buf
+ *
+ * Replies, notifications and announcements are sent through the ops of
+ * @ctx before returning.
+ *
+ * Return: 0 on success, negative errno if the message was rejected, -EBUSY
+ * and -ENOSPC when refused by the limits set with qrtr_ns_set_limits().
+ */
+int qrtr_ns_process_packet(struct qrtr_ns *ctx,
+			   const struct sockaddr_qrtr *from,
+			   const void *buf, size_t len)
+{
+	const struct qrtr_ctrl_pkt *msg = buf;
+	struct sockaddr_qrtr addr = *from;
+	struct sockaddr_qrtr *sq = &addr;
+	struct server_filter filter;
+	unsigned int flags;
+	unsigned int cmd;
+	int rc;
+
+	if (len < 4) {
+		LOGW("short packet from %u:%u", from->sq_node, from->sq_port);
+		return -EINVAL;
+	}
+
+	cmd = le32_to_cpu(msg->cmd);
+	if (cmd < ARRAY_SIZE(ctrl_pkt_strings) && ctrl_pkt_strings[cmd])
+		LOGD("%s from %u:%u\n", ctrl_pkt_strings[cmd], sq->sq_node, sq->sq_port);
+	else
+		LOGD("UNK (%08x) from %u:%u\n", cmd, sq->sq_node, sq->sq_port);
+
+	QRTR_PROBE(ns_cmd_entry, cmd, sq->sq_node, sq->sq_port);
+
+	rc = ns_admit(ctx, sq, cmd, buf, len);
+	if (rc < 0) {
+		/* The client waits for the end of the results regardless */
+		if (cmd == QRTR_TYPE_NEW_LOOKUP)
+			lookup_notify(ctx, sq, NULL, true);
+		goto out;
+	}
+
+	switch (cmd) {
+	case QRTR_TYPE_HELLO:
+		rc = ctrl_cmd_hello(ctx, sq, buf, len);
+		break;
+	case QRTR_TYPE_BYE:
+		rc = ctrl_cmd_bye(ctx, sq);
+		break;
+	case QRTR_TYPE_DEL_CLIENT:
+		rc = ctrl_cmd_del_client(ctx, sq,
+					 le32_to_cpu(msg->client.node),
+					 le32_to_cpu(msg->client.port));
+		break;
+	case QRTR_TYPE_NEW_SERVER:
+		rc = ctrl_cmd_new_server(ctx, sq,
+					 le32_to_cpu(msg->server.service),
+					 le32_to_cpu(msg->server.instance),
+					 le32_to_cpu(msg->server.node),
+					 le32_to_cpu(msg->server.port));
+		break;
+	case QRTR_TYPE_DEL_SERVER:
+		rc = ctrl_cmd_del_server(ctx, sq,
+					 le32_to_cpu(msg->server.service),
+					 le32_to_cpu(msg->server.instance),
+					 le32_to_cpu(msg->server.node),
+					 le32_to_cpu(msg->server.port));
+		break;
+	case QRTR_TYPE_RESUME_TX:
+		ns_resume(ctx, le32_to_cpu(msg->client.node),
+			  le32_to_cpu(msg->client.port));
+		break;
+	case QRTR_TYPE_EXIT:
+	case QRTR_TYPE_PING:
+		break;
+	case QRTR_TYPE_NEW_LOOKUP:
+		lookup_filter_parse(&filter, buf, len, &flags);
+		rc = ctrl_cmd_new_lookup(ctx, sq, &filter, flags);
+		break;
+	case QRTR_TYPE_DEL_LOOKUP:
+		lookup_filter_parse(&filter, buf, len, &flags);
+		rc = ctrl_cmd_del_lookup(ctx, sq, &filter, flags);
+		break;
+	case QRTR_TYPE_RESYNC_REQ:
+		rc = ctrl_cmd_resync_req(ctx, sq, buf, len);
+		break;
+	case QRTR_TYPE_RESYNC_ACK:
+		rc = ctrl_cmd_resync_ack(ctx, sq, buf, len);
+		break;
+	case QRTR_TYPE_RESYNC_DATA:
+		rc = ctrl_cmd_resync_data(ctx, sq, buf, len);
+		break;
+	case QRTR_TYPE_RESYNC_DONE:
+		rc = ctrl_cmd_resync_done(ctx, sq, buf, len);
+		break;
+	case QRTR_TYPE_TRACE_REQ:
+		rc = ctrl_cmd_trace_req(ctx, sq);
+		break;
+	}
+
+	if (rc < 0)
+		LOGW("failed while handling packet from %u:%u",
+		      sq->sq_node, sq->sq_port);
+
+out:
+	ns_trace_packet(ctx, from, cmd, buf, len, rc);
+	QRTR_PROBE(ns_cmd_exit, cmd, sq->sq_node, sq->sq_port, rc);
+	return rc;
+}
+
+/* Followed by the server records, then the lookup records */
+struct ns_state_hdr {
+	uint32_t servers;
+	uint32_t lookups;
+};
+
+struct ns_state_server {
+	uint32_t service;
+	uint32_t instance;
+	uint32_t node;
+	uint32_t port;
+};
+
+struct ns_state_lookup {
+	uint32_t node;
+	uint32_t port;
+
+	uint32_t service;
+	uint32_t instance;
+	uint32_t ifilter;
+	uint32_t imin;
+	uint32_t imax;
+};
+
+static int ns_state_put_servers(struct qrtr_ns *ctx, struct handover_buf *hb,
+				uint32_t *count)
+{
+	struct ns_state_server srec;
+	struct map_entry *node_me;
+	struct server *srv;
+	struct node *node;
+	unsigned int i;
+	int rc;
+
+	map_for_each(&ctx->nodes, node_me) {
+		node = map_iter_data(node_me, struct node, mi);
+
+		for (i = 0; i < node->servers.count; i++) {
+			srv = node->servers.srvs[i];
+
+			srec.service = srv->service;
+			srec.instance = srv->instance;
+			srec.node = srv->node;
+			srec.port = srv->port;
+
+			rc = handover_put(hb, &srec, sizeof(srec));
+			if (rc)
+				return rc;
+			(*count)++;
+		}
+	}
+
+	return 0;
+}
+
+static int ns_state_put_lookups(struct qrtr_ns *ctx, struct handover_buf *hb,
+				uint32_t *count)
+{
+	struct ns_state_lookup lrec;
+	struct lookup *lookup;
+	struct list_item *li;
+	int rc;
+
+	list_for_each(&ctx->lookups, li) {
+		lookup = container_of(li, struct lookup, li);
+
+		lrec.node = lookup->sq.sq_node;
+		lrec.port = lookup->sq.sq_port;
+		lrec.service = lookup->filter.service;
+		lrec.instance = lookup->filter.instance;
+		lrec.ifilter = lookup->filter.ifilter;
+		lrec.imin = lookup->filter.imin;
+		lrec.imax = lookup->filter.imax;
+
+		rc = handover_put(hb, &lrec, sizeof(lrec));
+		if (rc)
+			return rc;
+		(*count)++;
+	}
+
+	return 0;
+}
+
+static struct lookup *ns_state_add_lookup(struct qrtr_ns *ctx,
+					  const struct ns_state_lookup *lrec)
+{
+	struct lookup *lookup;
+
+	lookup = calloc(1, sizeof(*lookup));
+	if (!lookup)
+		return NULL;
+
+	lookup->sq.sq_family = AF_QIPCRTR;
+	lookup->sq.sq_node = lrec->node;
+	lookup->sq.sq_port = lrec->port;
+	lookup->filter.service = lrec->service;
+	lookup->filter.instance = lrec->instance;
+	lookup->filter.ifilter = lrec->ifilter;
+	lookup->filter.imin = lrec->imin;
+	lookup->filter.imax = lrec->imax;
+	list_append(&ctx->lookups, &lookup->li);
+
+	return lookup;
+}
+
+/*
+ * Whether a local port restored from a checkpoint is still open, probing it
+ * if the host can. Only a port known to be closed is dropped, when the probe
+ * can't tell the client is given the benefit of the doubt.
+ */
+static bool ns_state_port_open(struct qrtr_ns *ctx, unsigned int port)
+{
+	int rc;
+
+	if (!ctx->ops->probe)
+		return true;
+
+	rc = ctx->ops->probe(ctx->data, ctx->local_node, port);
+	if (rc == -ENODEV || rc == -ECONNRESET)
+		return false;
+
+	if (rc < 0)
+		LOGD("unable to probe port %u: %s\n", port, strerror(-rc));
+
+	return true;
+}
+
+/**
+ * qrtr_ns_trace_save() - Dump the trace of the last control packets handled
+ * @ctx:	Name service
+ * @data:	Returns the dump, to be freed by the caller
+ * @len:	Returns the length of @data
+ *
+ * The dump is a struct qrtr_trace_file followed by the records, oldest
+ * first, as rendered by qrtr-ns-trace.
+ *
+ * Return: 0 on success, negative errno on failure.
+ */
+int qrtr_ns_trace_save(struct qrtr_ns *ctx, void **data, size_t *len)
+{
+	struct qrtr_trace_file *hdr;
+	unsigned int count;
+
+	hdr = malloc(sizeof(*hdr) +
+		     NS_TRACE_SIZE * sizeof(struct qrtr_trace_rec));
+	if (!hdr)
+		return -ENOMEM;
+
+	count = ns_trace_snapshot(&ctx->trace, (void *)(hdr + 1));
+
+	hdr->magic = cpu_to_le32(QRTR_TRACE_MAGIC);
+	hdr->version = cpu_to_le32(QRTR_TRACE_VERSION);
+	hdr->count = cpu_to_le32(count);
+	hdr->reserved = 0;
+
+	*data = hdr;
+	*len = sizeof(*hdr) + count * sizeof(struct qrtr_trace_rec);
+
+	return 0;
+}
+
+/**
+ * qrtr_ns_state_save() - Serialize the registry and the lookups
+ * @ctx:	Name service
+ * @data:	Returns the state, to be freed by the caller
+ * @len:	Returns the length of @data
+ *
+ * The state is in host byte order, meant to be restored on the same
+ * machine by qrtr_ns_state_load().
+ *
+ * Return: 0 on success, negative errno on failure.
+ */
+int qrtr_ns_state_save(struct qrtr_ns *ctx, void **data, size_t *len)
+{
+	struct handover_buf hb = {};
+	struct ns_state_hdr hdr;
+	int rc;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	/* Filled in at the end */
+	rc = handover_put(&hb, &hdr, sizeof(hdr));
+	if (!rc)
+		rc = ns_state_put_servers(ctx, &hb, &hdr.servers);
+	if (!rc)
+		rc = ns_state_put_lookups(ctx, &hb, &hdr.lookups);
+	if (rc) {
+		handover_buf_free(&hb);
+		return rc;
+	}
+
+	memcpy(hb.data, &hdr, sizeof(hdr));
+
+	*data = hb.data;
+	*len = hb.len;
+
+	return 0;
+}
+
+/**
+ * qrtr_ns_state_load() - Restore the registry and the lookups
+ * @ctx:	Name service
+ * @data:	State from qrtr_ns_state_save()
+ * @len:	Length of @data
+ * @stale:	Mark servers as stale, see qrtr_ns_sweep_stale()
+ *
+ * With @stale, servers of remote nodes are stale until announced again.
+ * Local ports are probed through the probe op instead, the servers and
+ * lookups of those closed since the state was saved are dropped. Without a
+ * probe op local ports are trusted.
+ *
+ * Return: The number of servers marked stale, negative errno if the state
+ * is malformed.
+ */
+int qrtr_ns_state_load(struct qrtr_ns *ctx, const void *data, size_t len,
+		       bool stale)
+{
+	const struct ns_state_server *srec;
+	const struct ns_state_lookup *lrec;
+	const struct ns_state_hdr *hdr;
+	struct server *srv;
+	uint64_t expect;
+	unsigned int dropped = 0;
+	unsigned int count = 0;
+	unsigned int i;
+
+	hdr = data;
+	if (len < sizeof(*hdr))
+		return -EPROTO;
+
+	expect = sizeof(*hdr) + (uint64_t)hdr->servers * sizeof(*srec) +
+		 (uint64_t)hdr->lookups * sizeof(*lrec);
+	if (len != expect)
+		return -EPROTO;
+
+	srec = (const void *)(hdr + 1);
+	for (i = 0; i < hdr->servers; i++, srec++) {
+		if (stale && srec->node == ctx->local_node &&
+		    !ns_state_port_open(ctx, srec->port)) {
+			dropped++;
+			continue;
+		}
+
+		srv = server_add(ctx, srec->service, srec->instance,
+				 srec->node, srec->port);
+		if (!srv) {
+			LOGW("failed to restore server [%u:%x]@[%u:%u]",
+			     srec->service, srec->instance, srec->node,
+			     srec->port);
+			continue;
+		}
+
+		if (stale && srv->node != ctx->local_node) {
+			srv->stale = true;
+			count++;
+		}
+	}
+
+	lrec = (const void *)srec;
+	for (i = 0; i < hdr->lookups; i++, lrec++) {
+		if (stale && !ns_state_port_open(ctx, lrec->port)) {
+			dropped++;
+			continue;
+		}
+
+		if (!ns_state_add_lookup(ctx, lrec))
+			return -ENOMEM;
+	}
+
+	LOGD("restored %u servers and %u lookups, %u of closed ports dropped\n",
+	     hdr->servers, hdr->lookups, dropped);
+
+	return count;
+}
+
+bool qrtr_ns_state_dirty(struct qrtr_ns *ctx)
+{
+	return ctx->dirty;
+}
+
+void qrtr_ns_state_clean(struct qrtr_ns *ctx)
+{
+	ctx->dirty = false;
+}
+
+/**
+ * qrtr_ns_sweep_stale() - Drop the restored servers not announced again
+ * @ctx:	Name service
+ *
+ * Return: The number of servers dropped.
+ */
+unsigned int qrtr_ns_sweep_stale(struct qrtr_ns *ctx)
+{
+	struct map_entry *node_me;
+	unsigned int swept = 0;
+	struct server *srv;
+	struct node *node;
+	unsigned int i;
+
+	map_for_each(&ctx->nodes, node_me) {
+		node = map_iter_data(node_me, struct node, mi);
+
+		/* Removal moves the last server into the hole */
+		for (i = node->servers.count; i-- > 0;) {
+			srv = node->servers.srvs[i];
+			if (!srv->stale)
+				continue;
+
+			server_del(ctx, node, srv->port);
+			swept++;
+		}
+	}
+
+	return swept;
+}
+
+/* Announces this name service, and asks the others for their servers */
+int qrtr_ns_say_hello(struct qrtr_ns *ctx)
+{
+	struct qrtr_ctrl_pkt pkt;
+	int rc;
+
+	if (ctx->resync) {
+		rc = resync_hello(ctx, &ctx->bcast_sq, 0);
+		return rc < 0 ? rc : 0;
+	}
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.cmd = cpu_to_le32(QRTR_TYPE_HELLO);
+
+	rc = ns_send(ctx, &ctx->bcast_sq, &pkt, sizeof(pkt));
+	if (rc < 0)
+		return rc;
+
+	return 0;
+}
+
+/* Opt in to incremental resync with other name services */
+void qrtr_ns_set_resync(struct qrtr_ns *ctx, bool enable)
+{
+	if (enable && !ctx->resync)
+		resync_log_init(&ctx->rlog);
+	ctx->resync = enable;
+}
+
+/**
+ * qrtr_ns_set_limits() - Configure admission control
+ * @ctx:	Name service
+ * @limits:	Limits, zero fields are unlimited
+ *
+ * Rates are in packets per second, bursts default to one second's worth.
+ * Packets releasing resources are never refused, but still use up tokens.
+ */
+void qrtr_ns_set_limits(struct qrtr_ns *ctx,
+			const struct qrtr_ns_limits *limits)
+{
+	ctx->limits = *limits;
+}
+
+void qrtr_ns_get_stats(struct qrtr_ns *ctx, struct qrtr_ns_stats *stats)
+{
+	*stats = ctx->stats;
+}
+
+static void server_mi_free(struct map_item *mi)
+{
+	free(container_of(mi, struct server, mi));
+}
+
+static void node_mi_free(struct map_item *mi)
+{
+	struct node *node = container_of(mi, struct node, mi);
+
+	map_clear(&node->services, server_mi_free);
+	map_destroy(&node->services);
+	map_clear(&node->clients, client_mi_free);
+	map_destroy(&node->clients);
+	server_array_free(&node->servers);
+	free(node->shadow);
+
+	free(node);
+}
+
+static void service_index_mi_free(struct map_item *mi)
+{
+	struct service_index *idx = container_of(mi, struct service_index, mi);
+
+	server_array_free(&idx->servers);
+	free(idx);
+}
+
+/**
+ * qrtr_ns_create() - Create a name service
+ * @local_node:	Node the name service serves
+ * @ops:	Transport of control messages
+ * @data:	Passed to @ops
+ *
+ * The name service is driven by feeding it the messages received on the
+ * control port through qrtr_ns_process_packet(), and has no threads or timers
+ * of its own. All calls on one name service must be serialized.
+ *
+ * Return: The name service, or NULL on failure.
+ */
+struct qrtr_ns *qrtr_ns_create(unsigned int local_node,
+			       const struct qrtr_ns_ops *ops, void *data)
+{
+	struct qrtr_ns *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->local_node = local_node;
+	ctx->ops = ops;
+	ctx->data = data;
+	list_init(&ctx->lookups);
+
+	ctx->bcast_sq.sq_family = AF_QIPCRTR;
+	ctx->bcast_sq.sq_node = QRTR_NODE_BCAST;
+	ctx->bcast_sq.sq_port = QRTR_PORT_CTRL;
+
+	if (map_create(&ctx->nodes))
+		goto err;
+
+	if (map_create(&ctx->services)) {
+		map_destroy(&ctx->nodes);
+		goto err;
+	}
+
+	return ctx;
+
+err:
+	free(ctx);
+	return NULL;
+}
+
+void qrtr_ns_destroy(struct qrtr_ns *ctx)
+{
+	struct list_item *tmp;
+	struct list_item *li;
+
+	lookup_cache_clear(ctx);
+
+	list_for_each_safe(&ctx->lookups, li, tmp)
+		free(container_of(li, struct lookup, li));
+
+	map_clear(&ctx->services, service_index_mi_free);
+	map_destroy(&ctx->services);
+	map_clear(&ctx->nodes, node_mi_free);
+	map_destroy(&ctx->nodes);
+
+	free(ctx);
+}
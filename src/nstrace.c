@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <libgen.h>
+#include <libqrtr.h>
+#include <linux/qrtr.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "ns.h"
+
+#define TRACE_TIMEOUT_MS	1000
+
+static const struct {
+	unsigned int cmd;
+	const char *name;
+} cmd_names[] = {
+	{ QRTR_TYPE_HELLO, "hello" },
+	{ QRTR_TYPE_BYE, "bye" },
+	{ QRTR_TYPE_NEW_SERVER, "new-server" },
+	{ QRTR_TYPE_DEL_SERVER, "del-server" },
+	{ QRTR_TYPE_DEL_CLIENT, "del-client" },
+	{ QRTR_TYPE_RESUME_TX, "resume-tx" },
+	{ QRTR_TYPE_EXIT, "exit" },
+	{ QRTR_TYPE_PING, "ping" },
+	{ QRTR_TYPE_NEW_LOOKUP, "new-lookup" },
+	{ QRTR_TYPE_DEL_LOOKUP, "del-lookup" },
+	{ QRTR_TYPE_RESYNC_REQ, "resync-req" },
+	{ QRTR_TYPE_RESYNC_ACK, "resync-ack" },
+	{ QRTR_TYPE_RESYNC_DATA, "resync-data" },
+	{ QRTR_TYPE_RESYNC_DONE, "resync-done" },
+	{ QRTR_TYPE_TRACE_REQ, "trace-req" },
+};
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "%s [<trace>]\n", progname);
+	exit(1);
+}
+
+static void print_rec(const struct qrtr_trace_rec *rec)
+{
+	unsigned int cmd = le32_to_cpu(rec->cmd);
+	int result = (int32_t)le32_to_cpu(rec->result);
+	uint64_t ts = le64_to_cpu(rec->ts);
+	const char *name = NULL;
+	char unknown[16];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(cmd_names)/sizeof(cmd_names[0]); i++) {
+		if (cmd == cmd_names[i].cmd)
+			name = cmd_names[i].name;
+	}
+	if (!name) {
+		snprintf(unknown, sizeof(unknown), "0x%x", cmd);
+		name = unknown;
+	}
+
+	printf("[%5llu.%06llu] %-11s %4u:%-5u %9u %8u %4u:%-5u %s\n",
+	       (unsigned long long)(ts / 1000000000),
+	       (unsigned long long)(ts % 1000000000 / 1000),
+	       name, le32_to_cpu(rec->src_node), le32_to_cpu(rec->src_port),
+	       le32_to_cpu(rec->service), le32_to_cpu(rec->instance),
+	       le32_to_cpu(rec->node), le32_to_cpu(rec->port),
+	       result < 0 ? strerror(-result) : "ok");
+}
+
+static void print_header(void)
+{
+	printf("%-14s %-11s %-10s %9s %8s %-10s %s\n", "Time", "Command",
+	       "Source", "Service", "Instance", "Node:Port", "Result");
+}
+
+static void trace_file(const char *path)
+{
+	struct qrtr_trace_file hdr;
+	struct qrtr_trace_rec rec;
+	unsigned int count;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		PLOGE_AND_EXIT("unable to open %s", path);
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    le32_to_cpu(hdr.magic) != QRTR_TRACE_MAGIC)
+		LOGE_AND_EXIT("%s is not a qrtr-ns trace", path);
+
+	if (le32_to_cpu(hdr.version) != QRTR_TRACE_VERSION)
+		LOGE_AND_EXIT("unknown trace version %u",
+			      le32_to_cpu(hdr.version));
+
+	print_header();
+
+	for (count = le32_to_cpu(hdr.count); count; count--) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1)
+			LOGE_AND_EXIT("%s is truncated", path);
+
+		print_rec(&rec);
+	}
+
+	fclose(fp);
+}
+
+static void trace_query(void)
+{
+	uint64_t buf[QRTR_PACKED_MAX_SIZE / sizeof(uint64_t)];
+	const struct qrtr_ctrl_trace *pkt = (void *)buf;
+	struct qrtr_ctrl_pkt req = {};
+	struct sockaddr_qrtr ns;
+	struct sockaddr_qrtr sq;
+	unsigned int count;
+	unsigned int i;
+	socklen_t sl;
+	ssize_t len;
+	int sock;
+	int rc;
+
+	sock = qrtr_open(0);
+	if (sock < 0)
+		LOGE_AND_EXIT("unable to open qrtr socket");
+
+	sl = sizeof(ns);
+	if (getsockname(sock, (void *)&ns, &sl) < 0)
+		PLOGE_AND_EXIT("getsockname()");
+
+	req.cmd = cpu_to_le32(QRTR_TYPE_TRACE_REQ);
+	if (qrtr_sendto(sock, ns.sq_node, QRTR_PORT_CTRL, &req, sizeof(req)) < 0)
+		LOGE_AND_EXIT("unable to query the name service");
+
+	print_header();
+
+	for (;;) {
+		rc = qrtr_poll(sock, TRACE_TIMEOUT_MS);
+		if (rc < 0)
+			PLOGE_AND_EXIT("poll()");
+		if (!rc)
+			LOGE_AND_EXIT("no trace from the name service");
+
+		sl = sizeof(sq);
+		len = recvfrom(sock, buf, sizeof(buf), 0, (void *)&sq, &sl);
+		if (len < 0)
+			PLOGE_AND_EXIT("recvfrom()");
+
+		if (sq.sq_node != ns.sq_node || sq.sq_port != QRTR_PORT_CTRL ||
+		    len < sizeof(*pkt) ||
+		    le32_to_cpu(pkt->cmd) != QRTR_TYPE_TRACE_DATA)
+			continue;
+
+		/* Terminated by an empty TRACE_DATA */
+		count = le32_to_cpu(pkt->count);
+		if (!count)
+			break;
+
+		if (count > (len - sizeof(*pkt)) / sizeof(pkt->recs[0]))
+			count = (len - sizeof(*pkt)) / sizeof(pkt->recs[0]);
+
+		for (i = 0; i < count; i++)
+			print_rec(&pkt->recs[i]);
+	}
+
+	qrtr_close(sock);
+}
+
+int main(int argc, char **argv)
+{
+	const char *progname = basename(argv[0]);
+
+	qlog_setup(progname, false);
+
+	if (argc > 2)
+		usage(progname);
+
+	if (argc == 2)
+		trace_file(argv[1]);
+	else
+		trace_query();
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include "resync.h"
+#include "util.h"
+
+void resync_log_init(struct resync_log *log)
+{
+	memset(log, 0, sizeof(*log));
+
+	if (getrandom(&log->epoch, sizeof(log->epoch), GRND_NONBLOCK) !=
+	    sizeof(log->epoch))
+		log->epoch = time_ns() ^ ((uint32_t)getpid() << 16);
+
+	/* 0 stands for no epoch known */
+	if (!log->epoch)
+		log->epoch = 1;
+}
+
+void resync_log_add(struct resync_log *log, uint32_t service,
+		    uint32_t instance, uint32_t port)
+{
+	struct resync_entry *entry;
+
+	log->gen++;
+
+	entry = &log->entries[log->gen % RESYNC_LOG_SIZE];
+	entry->service = service;
+	entry->instance = instance;
+	entry->port = port;
+}
+
+/**
+ * resync_log_since() - Check if the changes since a generation are known
+ * @log:	Change log
+ * @gen:	Generation the peer has seen
+ *
+ * Return: The number of changes after @gen, available through
+ * resync_log_entry(), or -1 if they were overwritten already.
+ */
+int resync_log_since(const struct resync_log *log, uint32_t gen)
+{
+	if (gen > log->gen || log->gen - gen > RESYNC_LOG_SIZE)
+		return -1;
+
+	return log->gen - gen;
+}
@@ -0,0 +1,36 @@
+#ifndef _RESYNC_H_
+#define _RESYNC_H_
+
+#include <stdint.h>
+
+/* Local registry changes remembered for peers catching up */
+#define RESYNC_LOG_SIZE		256
+
+/* A change of the server on port, service 0 when it was removed */
+struct resync_entry {
+	uint32_t service;
+	uint32_t instance;
+	uint32_t port;
+};
+
+struct resync_log {
+	/* Identifies this instance, generations of others aren't comparable */
+	uint32_t epoch;
+	uint32_t gen;
+
+	struct resync_entry entries[RESYNC_LOG_SIZE];
+};
+
+void resync_log_init(struct resync_log *log);
+void resync_log_add(struct resync_log *log, uint32_t service,
+		    uint32_t instance, uint32_t port);
+int resync_log_since(const struct resync_log *log, uint32_t gen);
+
+/* The change which made generation @gen */
+static inline const struct resync_entry *
+resync_log_entry(const struct resync_log *log, uint32_t gen)
+{
+	return &log->entries[gen % RESYNC_LOG_SIZE];
+}
+
+#endif
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <linux/qrtr.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ns.h"
+#include "rxq.h"
+#include "util.h"
+
+#include "logging.h"
+
+static const char *rxq_class_names[RXQ_CLASSES] = {
+	[RXQ_LOCAL_LOOKUP]	= "local lookups",
+	[RXQ_LOCAL_REGISTRY]	= "local registrations",
+	[RXQ_REMOTE]		= "remote events",
+};
+
+/**
+ * rxq_init() - Set up the queues of a receive batch
+ * @rxq:	Receive queues
+ * @local_node:	Node id of the name service, telling local packets apart
+ *
+ * Return: 0 on success, negative errno on failure.
+ */
+int rxq_init(struct rxq *rxq, unsigned int local_node)
+{
+	memset(rxq, 0, sizeof(*rxq));
+	rxq->local_node = local_node;
+
+	rxq->msgs = calloc(RXQ_BATCH, sizeof(*rxq->msgs));
+	if (!rxq->msgs)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* Logs the latency of each class, packets still queued are dropped */
+void rxq_destroy(struct rxq *rxq)
+{
+	const struct rxq_stats *stats;
+	int cls;
+
+	for (cls = 0; cls < RXQ_CLASSES; cls++) {
+		stats = &rxq->stats[cls];
+
+		qlog(LOG_INFO, "rx %s: %llu messages, avg %lluus, max %lluus",
+		     rxq_class_names[cls], (unsigned long long)stats->count,
+		     (unsigned long long)(stats->count ?
+					  stats->total_ns / stats->count / 1000 : 0),
+		     (unsigned long long)(stats->max_ns / 1000));
+	}
+
+	free(rxq->msgs);
+	rxq->msgs = NULL;
+}
+
+static enum rxq_class rxq_classify(struct rxq *rxq, const struct rxq_msg *msg)
+{
+	const struct qrtr_ctrl_pkt *pkt = (const void *)msg->buf;
+
+	if (msg->sq.sq_node != rxq->local_node || msg->len < sizeof(pkt->cmd))
+		return RXQ_REMOTE;
+
+	switch (le32_to_cpu(pkt->cmd)) {
+	case QRTR_TYPE_NEW_LOOKUP:
+	case QRTR_TYPE_DEL_LOOKUP:
+		return RXQ_LOCAL_LOOKUP;
+	default:
+		return RXQ_LOCAL_REGISTRY;
+	}
+}
+
+/* Slot for the next packet received, NULL when the batch is full */
+struct rxq_msg *rxq_next(struct rxq *rxq)
+{
+	if (rxq->count == RXQ_BATCH)
+		return NULL;
+
+	return &rxq->msgs[rxq->count];
+}
+
+/**
+ * rxq_commit() - Queue the packet received into rxq_next()
+ * @rxq:	Receive queues
+ * @len:	Length of the packet
+ *
+ * Packets of a sender never overtake each other, a packet queued behind an
+ * earlier one of the same sender in a class of lower priority joins it
+ * there. So a port closed and reused can't see its lookups handled before
+ * the DEL_CLIENT of its previous user.
+ */
+void rxq_commit(struct rxq *rxq, size_t len)
+{
+	struct rxq_msg *msg = &rxq->msgs[rxq->count];
+	const struct rxq_msg *prev;
+	enum rxq_class cls;
+	unsigned int i;
+
+	msg->len = len;
+	msg->received = time_ns();
+
+	cls = rxq_classify(rxq, msg);
+	for (i = 0; i < rxq->count; i++) {
+		prev = &rxq->msgs[i];
+		if (prev->cls > cls && prev->sq.sq_node == msg->sq.sq_node &&
+		    prev->sq.sq_port == msg->sq.sq_port)
+			cls = prev->cls;
+	}
+
+	msg->cls = cls;
+	rxq->queue[cls][rxq->queued[cls]++] = rxq->count++;
+}
+
+/* Queue a packet received elsewhere, fails when the batch is full */
+int rxq_push(struct rxq *rxq, const struct sockaddr_qrtr *sq,
+	     const void *buf, size_t len)
+{
+	struct rxq_msg *msg;
+
+	msg = rxq_next(rxq);
+	if (!msg)
+		return -ENOBUFS;
+
+	if (len > sizeof(msg->buf))
+		len = sizeof(msg->buf);
+
+	msg->sq = *sq;
+	memcpy(msg->buf, buf, len);
+	rxq_commit(rxq, len);
+
+	return 0;
+}
+
+/**
+ * rxq_drain() - Handle the batch, by strict priority of the classes
+ * @rxq:	Receive queues
+ * @fn:		Handler of each packet
+ * @data:	Passed to @fn
+ *
+ * Lower classes wait no longer than one batch, as it's always drained
+ * completely before receiving more.
+ */
+void rxq_drain(struct rxq *rxq, rxq_fn fn, void *data)
+{
+	struct rxq_stats *stats;
+	struct rxq_msg *msg;
+	unsigned int i;
+	uint64_t ns;
+	int cls;
+
+	for (cls = 0; cls < RXQ_CLASSES; cls++) {
+		stats = &rxq->stats[cls];
+
+		for (i = 0; i < rxq->queued[cls]; i++) {
+			msg = &rxq->msgs[rxq->queue[cls][i]];
+
+			fn(data, &msg->sq, msg->buf, msg->len);
+
+			ns = time_ns() - msg->received;
+			stats->count++;
+			stats->total_ns += ns;
+			if (ns > stats->max_ns)
+				stats->max_ns = ns;
+		}
+
+		rxq->queued[cls] = 0;
+	}
+
+	rxq->count = 0;
+}
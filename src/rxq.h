@@ -0,0 +1,62 @@
+#ifndef _RXQ_H_
+#define _RXQ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/qrtr.h>
+
+/* Packets received before any of them is handled */
+#define RXQ_BATCH	64
+#define RXQ_MSG_SIZE	4096
+
+/* Classes of control packets, in order of priority */
+enum rxq_class {
+	RXQ_LOCAL_LOOKUP,
+	RXQ_LOCAL_REGISTRY,
+	RXQ_REMOTE,
+	RXQ_CLASSES,
+};
+
+struct rxq_msg {
+	struct sockaddr_qrtr sq;
+	enum rxq_class cls;
+	uint64_t received;
+	size_t len;
+	char buf[RXQ_MSG_SIZE];
+};
+
+struct rxq_stats {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+struct rxq {
+	unsigned int local_node;
+
+	struct rxq_msg *msgs;
+	unsigned int count;
+
+	/* Indices into msgs of each class, in arrival order */
+	unsigned int queue[RXQ_CLASSES][RXQ_BATCH];
+	unsigned int queued[RXQ_CLASSES];
+
+	/* Time from receiving to having handled a packet */
+	struct rxq_stats stats[RXQ_CLASSES];
+};
+
+typedef void (*rxq_fn)(void *data, struct sockaddr_qrtr *sq,
+		       const void *buf, size_t len);
+
+int rxq_init(struct rxq *rxq, unsigned int local_node);
+void rxq_destroy(struct rxq *rxq);
+
+struct rxq_msg *rxq_next(struct rxq *rxq);
+void rxq_commit(struct rxq *rxq, size_t len);
+int rxq_push(struct rxq *rxq, const struct sockaddr_qrtr *sq,
+	     const void *buf, size_t len);
+void rxq_drain(struct rxq *rxq, rxq_fn fn, void *data);
+
+#endif
@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sender.h"
+#include "txq.h"
+#include "util.h"
+
+#include "logging.h"
+
+#define SENDER_RING_SIZE	1024
+#define SENDER_RING_MASK	(SENDER_RING_SIZE - 1)
+
+/* Control packets fit, larger messages are copied to the heap */
+#define SENDER_MSG_SIZE		64
+
+enum sender_op {
+	SENDER_SEND,
+	SENDER_RESUME,
+	SENDER_DROP,
+};
+
+struct sender_entry {
+	enum sender_op op;
+	struct sockaddr_qrtr sq;
+	uint64_t enqueued;
+	size_t len;
+	char *data;
+	char buf[SENDER_MSG_SIZE];
+};
+
+struct sender_stage {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+struct sender {
+	int sock;
+	int efd;
+	pthread_t thread;
+
+	/* Written by the producer only */
+	unsigned int head __attribute__((aligned(64)));
+	uint64_t ring_full;
+
+	/* Written by the consumer only */
+	unsigned int tail __attribute__((aligned(64)));
+	int sleeping;
+	struct txq txq;
+	uint64_t last_flush;
+
+	/* Time spent in the ring, and sending */
+	struct sender_stage queue;
+	struct sender_stage send;
+
+	int stop;
+
+	struct sender_entry ring[SENDER_RING_SIZE];
+};
+
+static void sender_stage_add(struct sender_stage *stage, uint64_t ns)
+{
+	stage->count++;
+	stage->total_ns += ns;
+	if (ns > stage->max_ns)
+		stage->max_ns = ns;
+}
+
+static void sender_stage_log(const char *name, const struct sender_stage *stage)
+{
+	qlog(LOG_INFO, "sender %s: %llu messages, avg %lluus, max %lluus", name,
+	     (unsigned long long)stage->count,
+	     (unsigned long long)(stage->count ?
+				  stage->total_ns / stage->count / 1000 : 0),
+	     (unsigned long long)(stage->max_ns / 1000));
+}
+
+static void sender_wake(struct sender *s)
+{
+	uint64_t one = 1;
+
+	if (write(s->efd, &one, sizeof(one)) < 0)
+		PLOGW("eventfd write");
+}
+
+static struct sender_entry *sender_reserve(struct sender *s)
+{
+	bool full = false;
+
+	/* Wait for the sender thread to make room, this is the backpressure */
+	while (s->head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) >=
+	       SENDER_RING_SIZE) {
+		if (!full) {
+			s->ring_full++;
+			full = true;
+		}
+		sched_yield();
+	}
+
+	return &s->ring[s->head & SENDER_RING_MASK];
+}
+
+static void sender_commit(struct sender *s, struct sender_entry *e)
+{
+	e->enqueued = time_ns();
+
+	__atomic_store_n(&s->head, s->head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->sleeping, __ATOMIC_SEQ_CST))
+		sender_wake(s);
+}
+
+static void sender_process(struct sender *s, struct sender_entry *e)
+{
+	uint64_t start;
+
+	start = time_ns();
+	sender_stage_add(&s->queue, start - e->enqueued);
+
+	switch (e->op) {
+	case SENDER_SEND:
+		if (txq_sendto(&s->txq, &e->sq, e->data, e->len) < 0)
+			PLOGW("sendto(%u:%u)", e->sq.sq_node, e->sq.sq_port);
+		sender_stage_add(&s->send, time_ns() - start);
+
+		if (e->data != e->buf)
+			free(e->data);
+		break;
+	case SENDER_RESUME:
+		txq_resume(&s->txq, e->sq.sq_node, e->sq.sq_port);
+		break;
+	case SENDER_DROP:
+		txq_drop(&s->txq, e->sq.sq_node, e->sq.sq_port);
+		break;
+	}
+}
+
+static void sender_idle(struct sender *s)
+{
+	struct pollfd pfd = { .fd = s->efd, .events = POLLIN };
+	uint64_t val;
+	int rc;
+
+	__atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	/* Recheck, the producer might have missed that we're going to sleep */
+	if (s->tail != __atomic_load_n(&s->head, __ATOMIC_SEQ_CST) ||
+	    __atomic_load_n(&s->stop, __ATOMIC_SEQ_CST))
+		goto out;
+
+	rc = poll(&pfd, 1, txq_pending(&s->txq) ? TXQ_RETRY_MS : -1);
+	if (rc > 0 && read(s->efd, &val, sizeof(val)) < 0)
+		PLOGW("eventfd read");
+
+out:
+	__atomic_store_n(&s->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static void *sender_thread(void *data)
+{
+	struct sender *s = data;
+	uint64_t now;
+
+	for (;;) {
+		if (txq_pending(&s->txq)) {
+			now = time_ms();
+			if (now - s->last_flush >= TXQ_RETRY_MS) {
+				txq_flush(&s->txq);
+				s->last_flush = now;
+			}
+		}
+
+		if (s->tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) {
+			/* Drained, only stop once everything went out */
+			if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+				break;
+
+			sender_idle(s);
+			continue;
+		}
+
+		sender_process(s, &s->ring[s->tail & SENDER_RING_MASK]);
+
+		__atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/**
+ * sender_create() - Start a thread sending on behalf of the caller
+ * @sock:	Socket to send on
+ *
+ * Messages passed to sender_sendto() are handed to the thread through a
+ * single producer, single consumer ring, so all sender_*() calls must come
+ * from the same thread. The sender thread owns the transmit queue of
+ * backpressured destinations.
+ *
+ * Return: The sender, or NULL on failure.
+ */
+struct sender *sender_create(int sock)
+{
+	struct sender *s;
+	int rc;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->sock = sock;
+	txq_init(&s->txq, sock);
+
+	s->efd = eventfd(0, EFD_CLOEXEC);
+	if (s->efd < 0) {
+		PLOGW("eventfd");
+		free(s);
+		return NULL;
+	}
+
+	rc = pthread_create(&s->thread, NULL, sender_thread, s);
+	if (rc) {
+		LOGW("unable to create sender thread: %s", strerror(rc));
+		close(s->efd);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/**
+ * sender_destroy() - Stop the sender thread
+ * @s:		Sender
+ * @txq:	Transmit queue taking over destinations still backpressured
+ *
+ * Messages already queued are sent before the thread exits, then the
+ * latency metrics of each stage are logged.
+ */
+void sender_destroy(struct sender *s, struct txq *txq)
+{
+	__atomic_store_n(&s->stop, 1, __ATOMIC_SEQ_CST);
+	sender_wake(s);
+
+	pthread_join(s->thread, NULL);
+
+	sender_stage_log("queue", &s->queue);
+	sender_stage_log("send", &s->send);
+	if (s->ring_full)
+		qlog(LOG_INFO, "sender ring full %llu times",
+		     (unsigned long long)s->ring_full);
+	if (s->txq.dropped)
+		qlog(LOG_INFO, "sender dropped %u messages", s->txq.dropped);
+
+	txq_splice(txq, &s->txq);
+	close(s->efd);
+	free(s);
+}
+
+int sender_sendto(struct sender *s, const struct sockaddr_qrtr *sq,
+		  const void *buf, size_t len)
+{
+	struct sender_entry *e;
+	char *data;
+
+	e = sender_reserve(s);
+
+	if (len > SENDER_MSG_SIZE) {
+		data = malloc(len);
+		if (!data)
+			return -1;
+	} else {
+		data = e->buf;
+	}
+
+	e->op = SENDER_SEND;
+	e->sq = *sq;
+	e->len = len;
+	e->data = memcpy(data, buf, len);
+	sender_commit(s, e);
+
+	return len;
+}
+
+static void sender_control(struct sender *s, enum sender_op op,
+			   unsigned int node, unsigned int port)
+{
+	struct sender_entry *e;
+
+	e = sender_reserve(s);
+	e->op = op;
+	e->sq.sq_node = node;
+	e->sq.sq_port = port;
+	sender_commit(s, e);
+}
+
+/* Forwarded through the ring, as the sender thread owns the transmit queue */
+void sender_resume(struct sender *s, unsigned int node, unsigned int port)
+{
+	sender_control(s, SENDER_RESUME, node, port);
+}
+
+void sender_drop(struct sender *s, unsigned int node, unsigned int port)
+{
+	sender_control(s, SENDER_DROP, node, port);
+}
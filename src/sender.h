@@ -0,0 +1,20 @@
+#ifndef _SENDER_H_
+#define _SENDER_H_
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/qrtr.h>
+
+#include "txq.h"
+
+struct sender;
+
+struct sender *sender_create(int sock);
+void sender_destroy(struct sender *s, struct txq *txq);
+
+int sender_sendto(struct sender *s, const struct sockaddr_qrtr *sq,
+		  const void *buf, size_t len);
+void sender_resume(struct sender *s, unsigned int node, unsigned int port);
+void sender_drop(struct sender *s, unsigned int node, unsigned int port);
+
+#endif
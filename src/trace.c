@@ -0,0 +1,59 @@
+#include <linux/qrtr.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void ns_trace_rec(struct qrtr_trace_rec *rec,
+			 const struct ns_trace_entry *entry)
+{
+	rec->ts = cpu_to_le64(entry->ts);
+	rec->cmd = cpu_to_le32(entry->cmd);
+	rec->src_node = cpu_to_le32(entry->src_node);
+	rec->src_port = cpu_to_le32(entry->src_port);
+	rec->service = cpu_to_le32(entry->service);
+	rec->instance = cpu_to_le32(entry->instance);
+	rec->node = cpu_to_le32(entry->node);
+	rec->port = cpu_to_le32(entry->port);
+	rec->result = cpu_to_le32(entry->result);
+}
+
+/**
+ * ns_trace_snapshot() - Copy the trace ring
+ * @trace:	Trace ring
+ * @recs:	Room for NS_TRACE_SIZE records
+ *
+ * Safe against the writer running concurrently. The slot it might be
+ * filling when the copy is done is left out, as are the entries it
+ * overwrote meanwhile.
+ *
+ * Return: The number of records, oldest first.
+ */
+unsigned int ns_trace_snapshot(const struct ns_trace *trace,
+			       struct qrtr_trace_rec *recs)
+{
+	uint64_t first;
+	uint64_t head;
+	uint64_t end;
+	uint64_t i;
+
+	head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	first = head > NS_TRACE_SIZE ? head - NS_TRACE_SIZE : 0;
+
+	for (i = first; i < head; i++)
+		ns_trace_rec(&recs[i - first],
+			     &trace->entries[i & (NS_TRACE_SIZE - 1)]);
+
+	/* Entries up to where the writer is now may be torn */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	end = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+	if (end + 1 > first + NS_TRACE_SIZE) {
+		i = end + 1 - NS_TRACE_SIZE - first;
+		if (i > head - first)
+			i = head - first;
+
+		memmove(recs, recs + i, (head - first - i) * sizeof(*recs));
+		first += i;
+	}
+
+	return head - first;
+}
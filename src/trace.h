@@ -0,0 +1,47 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include "ns.h"
+
+/* Control packets remembered, a power of two */
+#define NS_TRACE_SIZE		2048
+
+struct ns_trace_entry {
+	uint64_t ts;
+	uint32_t cmd;
+	uint32_t src_node;
+	uint32_t src_port;
+	uint32_t service;
+	uint32_t instance;
+	uint32_t node;
+	uint32_t port;
+	int32_t result;
+};
+
+/*
+ * Written by a single thread, overwriting the oldest entries. Readers never
+ * block it, they drop what was overwritten while they copied.
+ */
+struct ns_trace {
+	uint64_t head;
+
+	struct ns_trace_entry entries[NS_TRACE_SIZE];
+};
+
+/* Slot for the next entry, published by ns_trace_commit() */
+static inline struct ns_trace_entry *ns_trace_next(struct ns_trace *trace)
+{
+	return &trace->entries[trace->head & (NS_TRACE_SIZE - 1)];
+}
+
+static inline void ns_trace_commit(struct ns_trace *trace)
+{
+	__atomic_store_n(&trace->head, trace->head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int ns_trace_snapshot(const struct ns_trace *trace,
+			       struct qrtr_trace_rec *recs);
+
+#endif
@@ -0,0 +1,258 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "txq.h"
+
+#include "logging.h"
+
+struct txq_msg {
+	struct list_item li;
+	size_t len;
+	char data[];
+};
+
+struct txq_dest {
+	struct sockaddr_qrtr sq;
+
+	struct list msgs;
+	unsigned int count;
+
+	struct list_item li;
+};
+
+void txq_init(struct txq *txq, int sock)
+{
+	txq->sock = sock;
+	txq->dropped = 0;
+	list_init(&txq->parked);
+}
+
+static void txq_dest_free(struct txq *txq, struct txq_dest *dest)
+{
+	struct list_item *li;
+
+	while ((li = list_pop(&dest->msgs)))
+		free(container_of(li, struct txq_msg, li));
+
+	list_remove(&txq->parked, &dest->li);
+	free(dest);
+}
+
+void txq_destroy(struct txq *txq)
+{
+	struct list_item *li;
+
+	while ((li = list_first(&txq->parked)))
+		txq_dest_free(txq, container_of(li, struct txq_dest, li));
+}
+
+static struct txq_dest *txq_dest_find(struct txq *txq, unsigned int node,
+				      unsigned int port)
+{
+	struct txq_dest *dest;
+	struct list_item *li;
+
+	list_for_each(&txq->parked, li) {
+		dest = container_of(li, struct txq_dest, li);
+		if (dest->sq.sq_node == node && dest->sq.sq_port == port)
+			return dest;
+	}
+
+	return NULL;
+}
+
+static int txq_enqueue(struct txq *txq, struct txq_dest *dest,
+		       const void *buf, size_t len)
+{
+	struct txq_msg *msg;
+
+	if (dest->count >= TXQ_MAX_PENDING) {
+		txq->dropped++;
+		LOGW("tx queue of %u:%u full, dropping message",
+		     dest->sq.sq_node, dest->sq.sq_port);
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	msg = malloc(sizeof(*msg) + len);
+	if (!msg)
+		return -1;
+
+	msg->len = len;
+	memcpy(msg->data, buf, len);
+
+	list_append(&dest->msgs, &msg->li);
+	dest->count++;
+
+	return len;
+}
+
+/**
+ * txq_sendto() - Send a message without blocking on flow control
+ * @txq:	Transmit queue
+ * @sq:		Destination of the message
+ * @buf:	Message to send
+ * @len:	Length of @buf
+ *
+ * If the destination is backpressured the message is copied and the
+ * destination parked, until txq_resume() or txq_flush() manage to send it.
+ * Messages to a parked destination are queued behind the ones already
+ * waiting, to retain ordering.
+ *
+ * Return: @len when the message was sent or queued, -1 with errno set on
+ * failure, like sendto().
+ */
+int txq_sendto(struct txq *txq, const struct sockaddr_qrtr *sq,
+	       const void *buf, size_t len)
+{
+	struct txq_dest *dest;
+	int rc;
+
+	dest = txq_dest_find(txq, sq->sq_node, sq->sq_port);
+	if (dest)
+		return txq_enqueue(txq, dest, buf, len);
+
+	rc = sendto(txq->sock, buf, len, MSG_DONTWAIT, (void *)sq, sizeof(*sq));
+	if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		return rc;
+
+	LOGD("parking %u:%u\n", sq->sq_node, sq->sq_port);
+
+	dest = calloc(1, sizeof(*dest));
+	if (!dest)
+		return -1;
+
+	dest->sq = *sq;
+	list_init(&dest->msgs);
+	list_append(&txq->parked, &dest->li);
+
+	return txq_enqueue(txq, dest, buf, len);
+}
+
+/* Returns true when the queue of @dest was drained */
+static bool txq_dest_flush(struct txq *txq, struct txq_dest *dest)
+{
+	struct txq_msg *msg;
+	struct list_item *li;
+	int rc;
+
+	while ((li = list_first(&dest->msgs))) {
+		msg = container_of(li, struct txq_msg, li);
+
+		rc = sendto(txq->sock, msg->data, msg->len, MSG_DONTWAIT,
+			    (void *)&dest->sq, sizeof(dest->sq));
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		if (rc < 0)
+			PLOGW("sendto(%u:%u)", dest->sq.sq_node, dest->sq.sq_port);
+
+		list_remove(&dest->msgs, li);
+		dest->count--;
+		free(msg);
+	}
+
+	LOGD("resumed %u:%u\n", dest->sq.sq_node, dest->sq.sq_port);
+
+	txq_dest_free(txq, dest);
+
+	return true;
+}
+
+/**
+ * txq_resume() - Send messages queued for a destination
+ * @txq:	Transmit queue
+ * @node:	Node of the destination
+ * @port:	Port of the destination
+ *
+ * Intended to be called on RESUME_TX from @node:@port.
+ */
+void txq_resume(struct txq *txq, unsigned int node, unsigned int port)
+{
+	struct txq_dest *dest;
+
+	dest = txq_dest_find(txq, node, port);
+	if (dest)
+		txq_dest_flush(txq, dest);
+}
+
+/**
+ * txq_flush() - Retry all parked destinations
+ * @txq:	Transmit queue
+ */
+void txq_flush(struct txq *txq)
+{
+	struct list_item *tmp;
+	struct list_item *li;
+
+	list_for_each_safe(&txq->parked, li, tmp)
+		txq_dest_flush(txq, container_of(li, struct txq_dest, li));
+}
+
+/**
+ * txq_drop() - Discard messages queued for a destination which went away
+ * @txq:	Transmit queue
+ * @node:	Node of the destination
+ * @port:	Port of the destination, 0 for all ports on @node
+ */
+void txq_drop(struct txq *txq, unsigned int node, unsigned int port)
+{
+	struct txq_dest *dest;
+	struct list_item *tmp;
+	struct list_item *li;
+
+	list_for_each_safe(&txq->parked, li, tmp) {
+		dest = container_of(li, struct txq_dest, li);
+		if (dest->sq.sq_node != node)
+			continue;
+		if (port && dest->sq.sq_port != port)
+			continue;
+
+		txq_dest_free(txq, dest);
+	}
+}
+
+/**
+ * txq_splice() - Move all parked destinations to another queue
+ * @dst:	Transmit queue taking over the destinations
+ * @src:	Transmit queue left empty
+ *
+ * @dst must not have any of the destinations of @src parked already.
+ */
+void txq_splice(struct txq *dst, struct txq *src)
+{
+	struct list_item *li;
+
+	while ((li = list_pop(&src->parked)))
+		list_append(&dst->parked, li);
+
+	dst->dropped += src->dropped;
+	src->dropped = 0;
+}
+
+/**
+ * txq_for_each() - Visit the queued messages, in the order they're sent
+ * @txq:	Transmit queue
+ * @fn:		Called with @data, the destination and each message
+ * @data:	Passed to @fn
+ */
+void txq_for_each(struct txq *txq,
+		  void (*fn)(void *data, const struct sockaddr_qrtr *sq,
+			     const void *buf, size_t len),
+		  void *data)
+{
+	struct txq_dest *dest;
+	struct list_item *dli;
+	struct list_item *mli;
+	struct txq_msg *msg;
+
+	list_for_each(&txq->parked, dli) {
+		dest = container_of(dli, struct txq_dest, li);
+
+		list_for_each(&dest->msgs, mli) {
+			msg = container_of(mli, struct txq_msg, li);
+			fn(data, &dest->sq, msg->data, msg->len);
+		}
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef _TXQ_H_
+#define _TXQ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/qrtr.h>
+
+#include "list.h"
+
+/* Messages held for a single parked destination, beyond this they're dropped */
+#define TXQ_MAX_PENDING	64
+
+/* Retry interval for parked destinations, should RESUME_TX never arrive */
+#define TXQ_RETRY_MS	100
+
+struct txq {
+	int sock;
+
+	/* Destinations with messages waiting for the remote to resume */
+	struct list parked;
+	unsigned int dropped;
+};
+
+void txq_init(struct txq *txq, int sock);
+void txq_destroy(struct txq *txq);
+
+int txq_sendto(struct txq *txq, const struct sockaddr_qrtr *sq,
+	       const void *buf, size_t len);
+void txq_resume(struct txq *txq, unsigned int node, unsigned int port);
+void txq_flush(struct txq *txq);
+void txq_drop(struct txq *txq, unsigned int node, unsigned int port);
+void txq_splice(struct txq *dst, struct txq *src);
+void txq_for_each(struct txq *txq,
+		  void (*fn)(void *data, const struct sockaddr_qrtr *sq,
+			     const void *buf, size_t len),
+		  void *data);
+
+static inline bool txq_pending(const struct txq *txq)
+{
+	return txq->parked.head != NULL;
+}
+
+#endif
@@ -0,0 +1,373 @@
+#include <errno.h>
+#include <liburing.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#include "logging.h"
+
+#define NS_URING_ENTRIES	256
+
+/* Provided buffer ring for multishot receive */
+#define NS_URING_BGID		0
+#define NS_URING_NBUFS		64
+#define NS_URING_BUF_SIZE	(4096 + 64)
+
+/* Buffers of this size are recycled, larger ones freed after use */
+#define NS_URING_TX_SIZE	256
+
+struct ns_uring_tx {
+	struct ns_uring_tx *next;
+
+	struct sockaddr_qrtr sq;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t size;
+	char buf[];
+};
+
+struct ns_uring {
+	struct io_uring ring;
+	int sock;
+
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	struct msghdr rx_msg;
+	bool rx_seen;
+	bool rx_armed;
+	bool stopping;
+
+	ns_uring_rx_fn rx;
+	void *data;
+
+	struct ns_uring_tx *tx_free;
+	unsigned int tx_inflight;
+};
+
+static struct io_uring_sqe *ns_uring_get_sqe(struct ns_uring *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ur->ring);
+	if (!sqe) {
+		/* Submission queue is full, flush it and retry */
+		io_uring_submit(&ur->ring);
+		sqe = io_uring_get_sqe(&ur->ring);
+	}
+
+	return sqe;
+}
+
+static int ns_uring_arm_recv(struct ns_uring *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ns_uring_get_sqe(ur);
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_recvmsg_multishot(sqe, ur->sock, &ur->rx_msg, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = NS_URING_BGID;
+	io_uring_sqe_set_data(sqe, NULL);
+	ur->rx_armed = true;
+
+	return 0;
+}
+
+/**
+ * ns_uring_create() - Set up io_uring based I/O for the control socket
+ * @sock:	Control socket
+ * @rx:		Called for each received message
+ * @data:	Passed to @rx
+ *
+ * Return: The new ring, or NULL if io_uring is unavailable.
+ */
+struct ns_uring *ns_uring_create(int sock, ns_uring_rx_fn rx, void *data)
+{
+	struct ns_uring *ur;
+	int rc;
+	int i;
+
+	ur = calloc(1, sizeof(*ur));
+	if (!ur)
+		return NULL;
+
+	ur->sock = sock;
+	ur->rx = rx;
+	ur->data = data;
+	ur->rx_msg.msg_namelen = sizeof(struct sockaddr_qrtr);
+
+	rc = io_uring_queue_init(NS_URING_ENTRIES, &ur->ring, 0);
+	if (rc < 0) {
+		LOGW("io_uring unavailable: %s", strerror(-rc));
+		free(ur);
+		return NULL;
+	}
+
+	ur->bufs = malloc(NS_URING_NBUFS * NS_URING_BUF_SIZE);
+	if (!ur->bufs)
+		goto err;
+
+	ur->br = io_uring_setup_buf_ring(&ur->ring, NS_URING_NBUFS,
+					 NS_URING_BGID, 0, &rc);
+	if (!ur->br) {
+		LOGW("io_uring buffer ring unavailable: %s", strerror(-rc));
+		goto err;
+	}
+
+	for (i = 0; i < NS_URING_NBUFS; i++)
+		io_uring_buf_ring_add(ur->br, ur->bufs + i * NS_URING_BUF_SIZE,
+				      NS_URING_BUF_SIZE, i,
+				      io_uring_buf_ring_mask(NS_URING_NBUFS), i);
+	io_uring_buf_ring_advance(ur->br, NS_URING_NBUFS);
+
+	rc = ns_uring_arm_recv(ur);
+	if (rc < 0)
+		goto err;
+
+	io_uring_submit(&ur->ring);
+
+	return ur;
+
+err:
+	if (ur->br)
+		io_uring_free_buf_ring(&ur->ring, ur->br, NS_URING_NBUFS,
+				       NS_URING_BGID);
+	io_uring_queue_exit(&ur->ring);
+	free(ur->bufs);
+	free(ur);
+	return NULL;
+}
+
+static void ns_uring_tx_put(struct ns_uring *ur, struct ns_uring_tx *tx)
+{
+	if (tx->size > NS_URING_TX_SIZE) {
+		free(tx);
+		return;
+	}
+
+	tx->next = ur->tx_free;
+	ur->tx_free = tx;
+}
+
+static void ns_uring_tx_done(struct ns_uring *ur, struct ns_uring_tx *tx,
+			     int res)
+{
+	if (res < 0)
+		LOGW("sendto(%u:%u): %s", tx->sq.sq_node, tx->sq.sq_port,
+		     strerror(-res));
+
+	ur->tx_inflight--;
+	ns_uring_tx_put(ur, tx);
+}
+
+int ns_uring_fd(struct ns_uring *ur)
+{
+	return ur->ring.ring_fd;
+}
+
+/**
+ * ns_uring_sendto() - Queue a message for sending
+ * @ur:		io_uring context
+ * @sq:		Destination of the message
+ * @buf:	Message to send, copied
+ * @len:	Length of @buf
+ *
+ * The message is only submitted at the end of ns_uring_process(), so that
+ * all messages generated while handling a batch of received messages go to
+ * the kernel in a single io_uring_submit() call.
+ *
+ * Return: @len on success, -1 with errno set on failure, like sendto().
+ */
+int ns_uring_sendto(struct ns_uring *ur, const struct sockaddr_qrtr *sq,
+		    const void *buf, size_t len)
+{
+	struct io_uring_sqe *sqe;
+	struct ns_uring_tx *tx;
+	size_t size;
+
+	/* Before taking an SQE, which can't be given back */
+	size = len > NS_URING_TX_SIZE ? len : NS_URING_TX_SIZE;
+	if (size == NS_URING_TX_SIZE && ur->tx_free) {
+		tx = ur->tx_free;
+		ur->tx_free = tx->next;
+	} else {
+		tx = malloc(sizeof(*tx) + size);
+		if (!tx)
+			return -1;
+		tx->size = size;
+	}
+
+	sqe = ns_uring_get_sqe(ur);
+	if (!sqe) {
+		ns_uring_tx_put(ur, tx);
+		errno = EBUSY;
+		return -1;
+	}
+
+	memcpy(tx->buf, buf, len);
+	tx->sq = *sq;
+	tx->iov.iov_base = tx->buf;
+	tx->iov.iov_len = len;
+
+	memset(&tx->msg, 0, sizeof(tx->msg));
+	tx->msg.msg_name = &tx->sq;
+	tx->msg.msg_namelen = sizeof(tx->sq);
+	tx->msg.msg_iov = &tx->iov;
+	tx->msg.msg_iovlen = 1;
+
+	io_uring_prep_sendmsg(sqe, ur->sock, &tx->msg, 0);
+	io_uring_sqe_set_data(sqe, tx);
+	ur->tx_inflight++;
+
+	return len;
+}
+
+static int ns_uring_rx_done(struct ns_uring *ur, struct io_uring_cqe *cqe)
+{
+	struct io_uring_recvmsg_out *out;
+	struct sockaddr_qrtr sq;
+	unsigned int bid;
+	unsigned int len;
+	void *payload;
+	char *buf;
+	int rc = 0;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ur->rx_armed = false;
+
+	if (cqe->res < 0) {
+		/* Multishot recvmsg requires Linux 6.0 */
+		if (cqe->res == -EINVAL && !ur->rx_seen)
+			return -EOPNOTSUPP;
+		if (cqe->res != -ENOBUFS)
+			return cqe->res;
+
+		LOGW("out of receive buffers");
+		goto rearm;
+	}
+
+	ur->rx_seen = true;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = ur->bufs + bid * NS_URING_BUF_SIZE;
+
+	out = io_uring_recvmsg_validate(buf, cqe->res, &ur->rx_msg);
+	if (!out || out->namelen < sizeof(sq)) {
+		LOGW("malformed io_uring receive completion");
+	} else if (out->flags & MSG_TRUNC) {
+		memcpy(&sq, io_uring_recvmsg_name(out), sizeof(sq));
+		LOGW("dropping oversized message from %u:%u",
+		     sq.sq_node, sq.sq_port);
+	} else {
+		memcpy(&sq, io_uring_recvmsg_name(out), sizeof(sq));
+		payload = io_uring_recvmsg_payload(out, &ur->rx_msg);
+		len = io_uring_recvmsg_payload_length(out, cqe->res,
+						      &ur->rx_msg);
+
+		ur->rx(ur->data, &sq, payload, len);
+	}
+
+	io_uring_buf_ring_add(ur->br, buf, NS_URING_BUF_SIZE, bid,
+			      io_uring_buf_ring_mask(NS_URING_NBUFS), 0);
+	io_uring_buf_ring_advance(ur->br, 1);
+
+rearm:
+	if (!ur->rx_armed && !ur->stopping)
+		rc = ns_uring_arm_recv(ur);
+
+	return rc;
+}
+
+/**
+ * ns_uring_destroy() - Tear down io_uring based I/O
+ * @ur:		io_uring context
+ *
+ * The multishot receive is cancelled first and messages it completed
+ * meanwhile are still dispatched, so nothing taken off the socket is lost
+ * and later messages stay queued on the socket. Queued messages go out
+ * before the ring is torn down.
+ */
+void ns_uring_destroy(struct ns_uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct ns_uring_tx *tx;
+	void *data;
+
+	ur->stopping = true;
+
+	if (ur->rx_armed) {
+		sqe = ns_uring_get_sqe(ur);
+		if (sqe) {
+			io_uring_prep_cancel64(sqe, 0, 0);
+			io_uring_sqe_set_data(sqe, ur);
+		} else {
+			ur->rx_armed = false;
+		}
+	}
+
+	io_uring_submit(&ur->ring);
+	while (ur->rx_armed || ur->tx_inflight) {
+		if (io_uring_wait_cqe(&ur->ring, &cqe) < 0)
+			break;
+
+		data = io_uring_cqe_get_data(cqe);
+		if (!data)
+			ns_uring_rx_done(ur, cqe);
+		else if (data != ur)
+			ns_uring_tx_done(ur, data, cqe->res);
+		io_uring_cqe_seen(&ur->ring, cqe);
+
+		/* Replies to the last messages received */
+		io_uring_submit(&ur->ring);
+	}
+
+	while ((tx = ur->tx_free)) {
+		ur->tx_free = tx->next;
+		free(tx);
+	}
+
+	io_uring_free_buf_ring(&ur->ring, ur->br, NS_URING_NBUFS,
+			       NS_URING_BGID);
+	io_uring_queue_exit(&ur->ring);
+	free(ur->bufs);
+	free(ur);
+}
+
+/**
+ * ns_uring_process() - Handle completed io_uring operations
+ * @ur:		io_uring context
+ *
+ * Dispatches all received messages and reclaims the buffers of completed
+ * sends, then submits the messages queued meanwhile. Intended to be called
+ * when ns_uring_fd() is readable.
+ *
+ * Return: 0 on success, -EOPNOTSUPP if the kernel lacks support for
+ * multishot receive, or negative errno on receive failure.
+ */
+int ns_uring_process(struct ns_uring *ur)
+{
+	struct io_uring_cqe *cqe;
+	struct ns_uring_tx *tx;
+	int rc = 0;
+
+	while (!rc && io_uring_peek_cqe(&ur->ring, &cqe) == 0) {
+		tx = io_uring_cqe_get_data(cqe);
+		if (tx)
+			ns_uring_tx_done(ur, tx, cqe->res);
+		else
+			rc = ns_uring_rx_done(ur, cqe);
+
+		io_uring_cqe_seen(&ur->ring, cqe);
+	}
+
+	io_uring_submit(&ur->ring);
+
+	return rc;
+}
@@ -0,0 +1,55 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/qrtr.h>
+
+struct ns_uring;
+
+typedef void (*ns_uring_rx_fn)(void *data, struct sockaddr_qrtr *sq,
+			       const void *buf, size_t len);
+
+#ifdef HAVE_LIBURING
+
+struct ns_uring *ns_uring_create(int sock, ns_uring_rx_fn rx, void *data);
+void ns_uring_destroy(struct ns_uring *ur);
+int ns_uring_fd(struct ns_uring *ur);
+int ns_uring_sendto(struct ns_uring *ur, const struct sockaddr_qrtr *sq,
+		    const void *buf, size_t len);
+int ns_uring_process(struct ns_uring *ur);
+
+#else
+
+static inline struct ns_uring *ns_uring_create(int sock, ns_uring_rx_fn rx,
+					       void *data)
+{
+	return NULL;
+}
+
+static inline void ns_uring_destroy(struct ns_uring *ur)
+{
+}
+
+static inline int ns_uring_fd(struct ns_uring *ur)
+{
+	return -1;
+}
+
+static inline int ns_uring_sendto(struct ns_uring *ur,
+				  const struct sockaddr_qrtr *sq,
+				  const void *buf, size_t len)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static inline int ns_uring_process(struct ns_uring *ur)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif
+
+#endif
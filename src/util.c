@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -12,6 +13,13 @@ uint64_t time_ms(void)
 	return (uint64_t)tv.tv_sec*1000 + tv.tv_usec/1000;
 }
 
+uint64_t time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
 void util_sleep(int ms)
 {
 	usleep(ms * 1000);
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 uint64_t time_ms(void);
+uint64_t time_ns(void);
 void util_sleep(int ms);
 
 #endif